@@ -0,0 +1,276 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Guest frame rate and display bus analyzer.
+
+Watches the bytes the SPI controller shifts out while the display's chip
+select is low, and splits them into guest frames: a frame ends after a
+full screen (1024 data bytes) has been sent, or early when the guest
+sends a command or releases chip select after some data. For each frame
+it logs the number of bytes sent, when the transfer started and ended,
+how many of those cycles the SPI bus was actually shifting, the interval
+since the previous frame started and how much of that interval the CPU
+spent sleeping.
+
+Nothing is hooked unless the analyzer is enabled: the IRQ hooks and the
+sleep callback wrapper are only installed by arduboy_analyzer_init().
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_time.h>
+#include <ssd1306_virt.h>
+
+#include "sim_arduboy.h"
+#include "arduboy_analyzer.h"
+
+
+#define FRAME_BYTES (OLED_WIDTH_PX*OLED_HEIGHT_PX/8)
+
+/* SPI control and status registers, data space addresses */
+#define SPCR_ADDR (0x4c)
+#define SPSR_ADDR (0x4d)
+#define SPCR_SPR_MASK (0x03)
+#define SPSR_SPI2X (0x01)
+
+/* frame interval histogram, 1 ms per bucket, the last one collects the rest */
+#define HIST_BUCKETS (64)
+
+struct frame_info {
+	uint32_t data_bytes;
+	uint32_t cmd_bytes;
+	avr_cycle_count_t start;
+	avr_cycle_count_t end;
+	avr_cycle_count_t spi_busy;
+};
+
+static struct mod_state {
+	avr_t *avr;
+	struct ssd1306_t *ssd1306;
+	FILE *log;
+	void (*sleep)(avr_t *avr, avr_cycle_count_t how_long);
+	avr_cycle_count_t sleep_cycles;
+	/* frame being transferred */
+	struct frame_info cur;
+	/* start of the previous frame and sleep cycles up to that point */
+	avr_cycle_count_t prev_start;
+	avr_cycle_count_t prev_sleep_cycles;
+	/* totals */
+	uint64_t frames;
+	uint64_t partial_frames;
+	uint64_t bytes;
+	avr_cycle_count_t transfer_cycles;
+	avr_cycle_count_t spi_busy_cycles;
+	avr_cycle_count_t interval_cycles;
+	avr_cycle_count_t interval_sleep_cycles;
+	avr_cycle_count_t min_interval;
+	avr_cycle_count_t max_interval;
+	uint32_t hist[HIST_BUCKETS];
+} mod_s;
+
+
+/* Cycles needed to shift out one byte at the current SPI clock rate */
+static avr_cycle_count_t spi_byte_cycles_(avr_t *avr)
+{
+	static const uint8_t spr_divider[4] = {4, 16, 64, 128};
+	uint8_t spcr = avr->data[SPCR_ADDR];
+	uint8_t spsr = avr->data[SPSR_ADDR];
+	avr_cycle_count_t divider = spr_divider[spcr & SPCR_SPR_MASK];
+	if (spsr & SPSR_SPI2X) {
+		divider >>= 1;
+	}
+	return 8 * divider;
+}
+
+static void frame_end_(bool partial)
+{
+	struct frame_info *f = &mod_s.cur;
+	avr_cycle_count_t interval = 0, sleep = 0;
+
+	/* the simulated SPI may take bytes faster than the nominal clock rate allows */
+	if (f->spi_busy > f->end - f->start) {
+		f->spi_busy = f->end - f->start;
+	}
+
+	if (mod_s.frames) {
+		interval = f->start - mod_s.prev_start;
+		sleep = mod_s.sleep_cycles - mod_s.prev_sleep_cycles;
+		/* sleep accounting is per sleep call, which may straddle the frame start */
+		if (sleep > interval) {
+			sleep = interval;
+		}
+		mod_s.interval_cycles += interval;
+		mod_s.interval_sleep_cycles += sleep;
+		if (!mod_s.min_interval || interval < mod_s.min_interval) {
+			mod_s.min_interval = interval;
+		}
+		if (interval > mod_s.max_interval) {
+			mod_s.max_interval = interval;
+		}
+		uint32_t bucket = avr_cycles_to_usec(mod_s.avr, interval) / 1000;
+		mod_s.hist[bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1]++;
+	}
+	mod_s.prev_start = f->start;
+	mod_s.prev_sleep_cycles = mod_s.sleep_cycles;
+
+	mod_s.frames++;
+	mod_s.partial_frames += partial;
+	mod_s.bytes += f->data_bytes + f->cmd_bytes;
+	mod_s.transfer_cycles += f->end - f->start;
+	mod_s.spi_busy_cycles += f->spi_busy;
+
+	if (mod_s.log) {
+		fprintf(mod_s.log, "%llu,%llu,%llu,%u,%u,%llu,%llu,%llu,%d\n",
+				(unsigned long long)mod_s.frames,
+				(unsigned long long)f->start, (unsigned long long)f->end,
+				f->data_bytes, f->cmd_bytes, (unsigned long long)f->spi_busy,
+				(unsigned long long)interval, (unsigned long long)sleep, partial);
+	}
+	memset(f, 0, sizeof(*f));
+}
+
+/* Registered after the controller, so this runs before it looks at the byte */
+static void analyzer_spi_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	ssd1306_t *ssd1306 = param;
+	if (ssd1306->cs_pin) {
+		/* not addressed to the display */
+		return;
+	}
+
+	struct frame_info *f = &mod_s.cur;
+	bool data = ssd1306->di_pin == SSD1306_VIRT_DATA;
+	if (!data && f->data_bytes) {
+		/* commands after data: the guest is starting over */
+		frame_end_(true);
+	}
+
+	/* the byte is handed over once the SPI controller has shifted it out */
+	avr_cycle_count_t now = mod_s.avr->cycle;
+	avr_cycle_count_t byte_cycles = spi_byte_cycles_(mod_s.avr);
+	if (!f->data_bytes && !f->cmd_bytes) {
+		f->start = now > byte_cycles ? now - byte_cycles : 0;
+	}
+	f->end = now;
+	f->spi_busy += byte_cycles;
+	if (!data) {
+		f->cmd_bytes++;
+		return;
+	}
+	if (++f->data_bytes == FRAME_BYTES) {
+		frame_end_(false);
+	}
+}
+
+static void analyzer_cs_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	/* chip select released in the middle of a frame */
+	if (value && mod_s.cur.data_bytes) {
+		frame_end_(true);
+	}
+}
+
+static void analyzer_sleep(avr_t *avr, avr_cycle_count_t how_long)
+{
+	/* the run loop advances the cycle counter by how_long + 1 */
+	mod_s.sleep_cycles += how_long + 1;
+	mod_s.sleep(avr, how_long);
+}
+
+/*
+Call after the display is connected and avr->sleep is set up. `log_path`
+receives one CSV line per guest frame.
+*/
+int arduboy_analyzer_init(avr_t *avr, struct ssd1306_t *ssd1306, const char *log_path)
+{
+	memset(&mod_s, 0, sizeof(mod_s));
+	mod_s.avr = avr;
+	mod_s.ssd1306 = ssd1306;
+
+	mod_s.log = fopen(log_path, "w");
+	if (!mod_s.log) {
+		perror("fopen");
+		return -1;
+	}
+	fprintf(mod_s.log, "frame,start_cycle,end_cycle,data_bytes,cmd_bytes,spi_busy_cycles,interval_cycles,sleep_cycles,partial\n");
+
+	avr_irq_register_notify(ssd1306->irq + IRQ_SSD1306_SPI_BYTE_IN, analyzer_spi_hook, ssd1306);
+	avr_irq_register_notify(ssd1306->irq + IRQ_SSD1306_ENABLE, analyzer_cs_hook, ssd1306);
+	mod_s.sleep = avr->sleep;
+	avr->sleep = analyzer_sleep;
+	return 0;
+}
+
+void arduboy_analyzer_report(void)
+{
+	if (!mod_s.avr) {
+		return;
+	}
+	printf("Analyzer: %llu guest frames (%llu partial), %llu display bytes\n",
+			(unsigned long long)mod_s.frames, (unsigned long long)mod_s.partial_frames,
+			(unsigned long long)mod_s.bytes);
+	if (mod_s.frames < 2) {
+		return;
+	}
+
+	avr_t *avr = mod_s.avr;
+	uint64_t intervals = mod_s.frames - 1;
+	double mean_interval_us = (double)avr_cycles_to_usec(avr, mod_s.interval_cycles) / intervals;
+	printf("  frame interval: mean %.2f ms (%.1f fps), min %.2f ms, max %.2f ms\n",
+			mean_interval_us / 1e3, 1e6 / mean_interval_us,
+			avr_cycles_to_usec(avr, mod_s.min_interval) / 1e3,
+			avr_cycles_to_usec(avr, mod_s.max_interval) / 1e3);
+	printf("  transfer: mean %.2f ms per frame, SPI busy %.1f%% of it\n",
+			(double)avr_cycles_to_usec(avr, mod_s.transfer_cycles) / mod_s.frames / 1e3,
+			mod_s.transfer_cycles ? 100.0 * mod_s.spi_busy_cycles / mod_s.transfer_cycles : 0.0);
+	printf("  CPU: %.1f%% running, %.1f%% sleeping\n",
+			100.0 * (mod_s.interval_cycles - mod_s.interval_sleep_cycles) / mod_s.interval_cycles,
+			100.0 * mod_s.interval_sleep_cycles / mod_s.interval_cycles);
+
+	uint32_t peak = 0;
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (mod_s.hist[i] > peak) {
+			peak = mod_s.hist[i];
+		}
+	}
+	printf("  frame interval histogram:\n");
+	for (int i = 0; i < HIST_BUCKETS; i++) {
+		if (!mod_s.hist[i]) {
+			continue;
+		}
+		char bar[41];
+		int len = (uint64_t)mod_s.hist[i] * (sizeof(bar) - 1) / peak;
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		printf("  %s%2d ms (%6.1f fps) %8u %s\n", i == HIST_BUCKETS - 1 ? ">=" : "  ", i,
+				1e3 / (i + 0.5), mod_s.hist[i], bar);
+	}
+}
+
+void arduboy_analyzer_teardown(void)
+{
+	if (mod_s.log) {
+		fclose(mod_s.log);
+		mod_s.log = NULL;
+	}
+	mod_s.avr = NULL;
+}
@@ -0,0 +1,25 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+struct avr_t;
+struct ssd1306_t;
+
+int arduboy_analyzer_init(struct avr_t *avr, struct ssd1306_t *ssd1306, const char *log_path);
+void arduboy_analyzer_report(void);
+void arduboy_analyzer_teardown(void);
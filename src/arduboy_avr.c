@@ -24,6 +24,9 @@
 #include <stdlib.h>
 
 #include <sim_avr.h>
+#include <sim_core.h>
+#include <sim_cycle_timers.h>
+#include <sim_interrupts.h>
 #include <avr_adc.h>
 #include <avr_ioport.h>
 #include <avr_extint.h>
@@ -34,8 +37,15 @@
 
 #include "sim_arduboy.h"
 #include "arduboy_avr.h"
+#include "arduboy_analyzer.h"
+#include "arduboy_mem.h"
+#include "arduboy_predecode.h"
+#include "arduboy_present.h"
+#include "arduboy_run.h"
 #include "arduboy_sdl.h"
+#include "arduboy_shm.h"
 #include "ssd1306_gl.h"
+#include "ssd1306_luma.h"
 
 
 #define MHZ_16 (16000000)
@@ -72,9 +82,23 @@ static struct arduboy_avr_mod_state {
 	struct avr_t *avr;
 	ssd1306_t ssd1306;
 	uint64_t start_time_ns;
+	uint64_t batches;
+	uint64_t frame;
+	uint64_t luma_frame;
+	bool headless;
+	bool vsync;
+	bool predecode;
 	bool yield;
+	bool mem_report;
 } mod_s;
 
+static uint64_t monotonic_time_ns(void)
+{
+	struct timespec tp;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+	return tp.tv_sec*1000000000+tp.tv_nsec;
+}
+
 /*
 Simavr's default sleep callback results in simulated time and
 wall clock time to diverge over time. This replacement tries to
@@ -85,12 +109,9 @@ static void avr_callback_sleep_sync(
 		avr_t *avr,
 		avr_cycle_count_t how_long)
 {
-	struct timespec tp;
-
 	/* figure out how long we should wait to match the sleep deadline */
 	uint64_t deadline_ns = avr_cycles_to_nsec(avr, avr->cycle + how_long);
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	uint64_t runtime_ns = (tp.tv_sec*1000000000+tp.tv_nsec) - mod_s.start_time_ns;
+	uint64_t runtime_ns = monotonic_time_ns() - mod_s.start_time_ns;
 	if (runtime_ns >= deadline_ns) {
 		return;
 	}
@@ -100,13 +121,91 @@ static void avr_callback_sleep_sync(
 	return;
 }
 
-static avr_cycle_count_t update_luma(
+/* Sleep callback used when running unthrottled: simulated time just jumps ahead */
+static void avr_callback_sleep_none(
 		avr_t *avr,
-		avr_cycle_count_t when,
-		void *param)
+		avr_cycle_count_t how_long)
 {
-	ssd1306_gl_update_lumamap(param, LUMA_DECAY, LUMA_INC);
-	return avr->cycle + avr_usec_to_cycles(avr, SSD1306_FRAME_PERIOD_US);
+}
+
+/*
+Same as simavr's avr_callback_run_raw() except that, rather than
+returning after every instruction, it runs straight up to the earliest
+of: the next cycle timer deadline, an interrupt becoming serviceable or
+a CPU state change (sleep, crash...). Cycle timers and interrupts are
+still processed at exactly the same cycle they would be by the reference
+loop, but the timer, sleep and interrupt bookkeeping and the caller's
+loop control checks only run at batch boundaries. Batches shrink
+automatically when timer events are dense (e.g. during SPI transfers)
+and grow when they are sparse.
+*/
+static void arduboy_avr_run_batch(avr_t *avr)
+{
+	avr_flashaddr_t new_pc = avr->pc;
+
+	if (avr->state == cpu_Running && mod_s.predecode) {
+		new_pc = arduboy_predecode_run(avr);
+	} else if (avr->state == cpu_Running) {
+		new_pc = avr_run_one(avr);
+		while (avr->state == cpu_Running &&
+				!(avr->interrupt_state && avr->sreg[S_I]) &&
+				avr->cycle < arduboy_run_deadline(avr)) {
+			avr->pc = new_pc;
+			new_pc = avr_run_one(avr);
+		}
+	}
+	mod_s.batches++;
+
+	/* run the cycle timers, get the suggested sleep time until the next timer is due */
+	avr_cycle_count_t sleep = avr_cycle_timer_process(avr);
+
+	avr->pc = new_pc;
+
+	if (avr->state == cpu_Sleeping) {
+		if (!avr->sreg[S_I]) {
+			if (avr->log)
+				AVR_LOG(avr, LOG_TRACE, "simavr: sleeping with interrupts off, quitting gracefully\n");
+			avr->state = cpu_Done;
+			return;
+		}
+		avr->sleep(avr, sleep);
+		avr->cycle += 1 + sleep;
+	}
+	/* interrupt servicing might change the PC too, during 'sleep' */
+	if (avr->state == cpu_Running || avr->state == cpu_Sleeping)
+		avr_service_interrupts(avr);
+}
+
+static uint8_t buttons_pressed(void)
+{
+	uint8_t mask = 0;
+	for (int btn_idx=0; btn_idx<BTN_COUNT; btn_idx++) {
+		if (buttons[btn_idx].pressed) {
+			mask |= 1 << btn_idx;
+		}
+	}
+	return mask;
+}
+
+static void apply_shm_input(void)
+{
+	uint8_t pressed;
+	uint8_t changed = arduboy_shm_poll_input(&pressed);
+	for (int btn_idx=0; changed; btn_idx++, changed >>= 1, pressed >>= 1) {
+		if (changed & 0x1) {
+			arduboy_avr_button_event(btn_idx, pressed & 0x1);
+		}
+	}
+}
+
+/* Bring the luma map up to date and publish it as a new shm frame */
+static void luma_frame_(avr_t *avr)
+{
+	/* luma is computed lazily, only when a frame is presented */
+	arduboy_shm_frame_begin();
+	ssd1306_luma_update();
+	mod_s.luma_frame++;
+	arduboy_shm_frame_end(mod_s.luma_frame, avr->cycle, buttons_pressed());
 }
 
 static avr_cycle_count_t render_timer_callback(
@@ -114,12 +213,33 @@ static avr_cycle_count_t render_timer_callback(
 			avr_cycle_count_t when,
 			void *param)
 {
-	ssd1306_gl_render(param);
-	arduboy_sdl_render_frame();
+	mod_s.frame++;
+	if (!mod_s.vsync) {
+		luma_frame_(avr);
+		if (!mod_s.headless) {
+			arduboy_present_frame(param, ssd1306_luma_pixmap(), avr_cycles_to_nsec(avr, avr->cycle));
+		}
+	}
+	apply_shm_input();
 	mod_s.yield = true;
 	return avr->cycle + avr_usec_to_cycles(avr, GL_FRAME_PERIOD_US);
 }
 
+/*
+With vsync the render thread blends between published frames, so luma
+frames are produced at the controller's own frame rate. Frame accounting
+and yielding stay with the render timer.
+*/
+static avr_cycle_count_t publish_timer_callback(
+			avr_t *avr,
+			avr_cycle_count_t when,
+			void *param)
+{
+	luma_frame_(avr);
+	arduboy_present_frame(param, ssd1306_luma_pixmap(), avr_cycles_to_nsec(avr, avr->cycle));
+	return avr->cycle + avr_usec_to_cycles(avr, SSD1306_FRAME_PERIOD_US);
+}
+
 struct ssd1306_t *arduboy_avr_ssd1306(void)
 {
 	return &mod_s.ssd1306;
@@ -134,6 +254,36 @@ void arduboy_avr_button_event(enum button_e btn_e, bool pressed)
 	}
 }
 
+/* Set the state of all buttons at once, bit n of `pressed` is button_e n */
+void arduboy_avr_set_buttons(uint8_t pressed)
+{
+	for (int btn_idx=0; btn_idx<BTN_COUNT; btn_idx++) {
+		arduboy_avr_button_event(btn_idx, (pressed >> btn_idx) & 0x1);
+	}
+}
+
+void arduboy_avr_get_status(struct arduboy_avr_status *status)
+{
+	avr_t *avr = mod_s.avr;
+	status->frame = mod_s.frame;
+	status->cycle = avr->cycle;
+	status->pc = avr->pc;
+	/* simavr keeps SREG unpacked */
+	status->sreg = 0;
+	for (int i = 0; i < 8; i++) {
+		status->sreg |= (avr->sreg[i] != 0) << i;
+	}
+	status->state = avr->state;
+	status->buttons = buttons_pressed();
+}
+
+/* Data space: registers, I/O and SRAM */
+const uint8_t *arduboy_avr_data(uint32_t *size)
+{
+	*size = mod_s.avr->ramend + 1;
+	return mod_s.avr->data;
+}
+
 void arduboy_adc_update_hook(struct avr_irq_t *irq, uint32_t value, void *param)
 {
 	avr_irq_t *iop_irq = avr_io_getirq(mod_s.avr, AVR_IOCTL_ADC_GETIRQ, ADC_IRQ_ADC1);
@@ -141,7 +291,7 @@ void arduboy_adc_update_hook(struct avr_irq_t *irq, uint32_t value, void *param)
 	avr_raise_irq(iop_irq, milivolts);
 }
 
-void arduboy_avr_loop(void)
+int arduboy_avr_loop(void)
 {
 	avr_t *avr = mod_s.avr;
 	mod_s.yield = false;
@@ -149,8 +299,9 @@ void arduboy_avr_loop(void)
 		avr->run(avr);
 		int state = avr->state;
 		if (state == cpu_Done || state == cpu_Crashed)
-			break;
+			return -1;
 	}
+	return 0;
 }
 
 int arduboy_avr_setup(struct sim_arduboy_opts *opts)
@@ -187,17 +338,38 @@ int arduboy_avr_setup(struct sim_arduboy_opts *opts)
 		avr->codeend = avr->flashend;
 	}
 
+	/* lean: instances running the same ROM share its flash pages */
+	if (opts->lean && arduboy_mem_share_flash(&avr->flash, avr->flashend + 1)) {
+		fprintf(stderr, "Unable to share flash image, using a private copy\n");
+	}
+
 	/* more simulation parameters */
 	avr->log = 1 + opts->verbose;
 	avr->frequency = MHZ_16;
-	avr->sleep = avr_callback_sleep_sync;
+	avr->sleep = opts->unthrottled ? avr_callback_sleep_none : avr_callback_sleep_sync;
 	avr->run_cycle_limit = avr_usec_to_cycles(avr, 2*GL_FRAME_PERIOD_US);
 	avr->aref = ADC_VREF_V256;
 
 	/* setup and connect display controller */
 	ssd1306_init(avr, &mod_s.ssd1306, OLED_WIDTH_PX, OLED_HEIGHT_PX);
 	ssd1306_connect(&mod_s.ssd1306, &ssd1306_wiring);
-	ssd1306_gl_init(opts->pixel_size, opts->win_width, opts->win_height);
+
+	/* optionally publish frames through shared memory, luma is then integrated in place */
+	uint8_t *luma_pixmap = NULL;
+	if (opts->shm_name && arduboy_shm_setup(opts->shm_name, &luma_pixmap)) {
+		return -1;
+	}
+	if (ssd1306_luma_init(&mod_s.ssd1306, LUMA_TAU_US, luma_pixmap)) {
+		return -1;
+	}
+	if (opts->analyzer_log && arduboy_analyzer_init(avr, &mod_s.ssd1306, opts->analyzer_log)) {
+		return -1;
+	}
+	mod_s.headless = opts->headless;
+	if (!mod_s.headless) {
+		ssd1306_gl_init(opts->pixel_size, opts->win_width, opts->win_height);
+	}
+	mod_s.mem_report = opts->mem_report;
 
 	/* setup and connect buttons */
 	for (int btn_idx=0; btn_idx<BTN_COUNT; btn_idx++) {
@@ -211,13 +383,15 @@ int arduboy_avr_setup(struct sim_arduboy_opts *opts)
 	}
 
 	/* Take simulation start time */
-	struct timespec tp;
-	clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-	mod_s.start_time_ns = tp.tv_sec*1000000000+tp.tv_nsec;
+	mod_s.start_time_ns = monotonic_time_ns();
 
-	/* Setup display render timers */
-	avr_cycle_timer_register_usec(avr, SSD1306_FRAME_PERIOD_US, update_luma, &mod_s.ssd1306);
+	/* Setup display render timer */
 	avr_cycle_timer_register_usec(avr, GL_FRAME_PERIOD_US, render_timer_callback, &mod_s.ssd1306);
+	/* with vsync the render thread picks the frames it needs from those published */
+	mod_s.vsync = opts->vsync && !opts->headless;
+	if (mod_s.vsync) {
+		avr_cycle_timer_register_usec(avr, SSD1306_FRAME_PERIOD_US, publish_timer_callback, &mod_s.ssd1306);
+	}
 
 	/* Setup initial random seed */
 	srand((unsigned int)time(NULL));
@@ -231,13 +405,61 @@ int arduboy_avr_setup(struct sim_arduboy_opts *opts)
 	if (opts->debug) {
 		avr->state = cpu_Stopped;
 		avr_gdb_init(avr);
+	} else if (!opts->reference_loop) {
+		avr->run = arduboy_avr_run_batch;
+		/* the instruction cache is built after the image is loaded */
+		if (opts->predecode) {
+			if (arduboy_predecode_init(avr, opts->predecode_verify)) {
+				return -1;
+			}
+			mod_s.predecode = true;
+		}
 	}
 
 	mod_s.avr = avr;
 	return 0;
 }
 
-void arduboy_avr_teardown(void)
+static void mem_report_(avr_t *avr)
 {
+	bool flash_shared = arduboy_mem_flash_shared();
+	struct arduboy_mem_component components[] = {
+		{"flash", avr->flashend + 1, flash_shared},
+		{"data", avr->ramend + 1, false},
+		{"eeprom", avr->e2end + 1, false},
+		{"irqs", avr->irq_pool.count * sizeof(avr_irq_t), false},
+		{"avr_t", sizeof(*avr), false},
+		{"ssd1306", sizeof(mod_s.ssd1306), false},
+		{"luma", ssd1306_luma_mem_size(), false},
+		{"predecode", arduboy_predecode_mem_size(), false},
+		{"shm", arduboy_shm_mem_size(), true},
+	};
+	arduboy_mem_report(components, sizeof(components)/sizeof(components[0]));
+}
 
+void arduboy_avr_teardown(void)
+{
+	avr_t *avr = mod_s.avr;
+	arduboy_analyzer_report();
+	if (avr && mod_s.mem_report) {
+		mem_report_(avr);
+	}
+	if (avr && avr->log > 1) {
+		uint64_t runtime_ns = monotonic_time_ns() - mod_s.start_time_ns;
+		printf("Ran %llu cycles in %.3f s: %.2f emulated MHz",
+				(unsigned long long)avr->cycle, runtime_ns/1e9, avr->cycle*1e3/runtime_ns);
+		if (mod_s.batches) {
+			printf(", %.1f cycles/batch", (double)avr->cycle/mod_s.batches);
+		}
+		printf("\n");
+		arduboy_predecode_report();
+		arduboy_present_report();
+	}
+	arduboy_analyzer_teardown();
+	arduboy_predecode_teardown();
+	arduboy_shm_teardown();
+	if (avr && arduboy_mem_flash_shared()) {
+		arduboy_mem_unshare_flash();
+		avr->flash = NULL;
+	}
 }
\ No newline at end of file
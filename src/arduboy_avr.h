@@ -18,13 +18,26 @@
 */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 
 struct sim_arduboy_opts;
 enum button_e;
 
+struct arduboy_avr_status {
+	uint64_t frame;
+	uint64_t cycle;
+	uint32_t pc;
+	uint8_t sreg;
+	uint8_t state;
+	uint8_t buttons;
+};
+
 int arduboy_avr_setup(struct sim_arduboy_opts *opts);
-void arduboy_avr_loop(void);
+int arduboy_avr_loop(void);
 void arduboy_avr_teardown(void);
 
 void arduboy_avr_button_event(enum button_e btn_e, bool pressed);
+void arduboy_avr_set_buttons(uint8_t pressed);
+void arduboy_avr_get_status(struct arduboy_avr_status *status);
+const uint8_t *arduboy_avr_data(uint32_t *size);
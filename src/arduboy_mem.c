@@ -0,0 +1,317 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Memory footprint accounting and reduction.
+
+The report lists the bytes each simulator component asked for next to
+what the kernel says the process actually uses, so the cost of one more
+simulation per host can be read off directly: RSS minus the file backed
+and shared pages is what every extra instance adds.
+
+Flash sharing maps the loaded image copy-on-write from a POSIX shared
+memory object named after a hash of its content, so all instances
+running the same ROM share its physical pages. The first instance to
+get there creates the object and fills it through a shared mapping,
+then sets a ready marker stored after the image. The others wait for
+the marker before mapping it, so an object is never used, or removed,
+while its creator is still writing it. Only an object whose marker
+never shows up, because its creator died, is unlinked and replaced. A
+page only becomes private if the guest rewrites it with SPM.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "arduboy_mem.h"
+
+
+#define FNV1A64_OFFSET (0xcbf29ce484222325ULL)
+#define FNV1A64_PRIME (0x100000001b3ULL)
+
+/* "SAFLASH1", set once the object holds the whole image */
+#define FLASH_READY_MAGIC (0x3148534c41464153ULL)
+/* how long to wait for another instance to finish publishing an image */
+#define FLASH_READY_TIMEOUT_US (2000000)
+#define FLASH_READY_POLL_US (1000)
+#define FLASH_SHARE_ATTEMPTS (2)
+
+struct flash_marker {
+	uint64_t magic;
+	uint64_t size;
+};
+
+enum flash_object_state {
+	FLASH_OBJECT_READY,
+	FLASH_OBJECT_STALE,
+	FLASH_OBJECT_FOREIGN,
+};
+
+static struct mod_state {
+	uint8_t *flash;
+	size_t flash_size;
+} mod_s;
+
+
+static uint64_t fnv1a64_(const uint8_t *data, size_t size)
+{
+	uint64_t hash = FNV1A64_OFFSET;
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * FNV1A64_PRIME;
+	}
+	return hash;
+}
+
+/* Returns the value in kB of `key` in a /proc "Key:   value kB" file, or -1 */
+static long proc_kb_(const char *path, const char *key)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	char line[256];
+	size_t key_len = strlen(key);
+	long kb = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, key, key_len) && line[key_len] == ':') {
+			kb = strtol(line + key_len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return kb;
+}
+
+void arduboy_mem_report(const struct arduboy_mem_component *components, int count)
+{
+	size_t private_total = 0, shared_total = 0;
+
+	printf("Memory footprint by component:\n");
+	for (int i = 0; i < count; i++) {
+		const struct arduboy_mem_component *c = &components[i];
+		printf("  %-16s %8zu B%s\n", c->name, c->bytes, c->shared ? " (shared)" : "");
+		if (c->shared) {
+			shared_total += c->bytes;
+		} else {
+			private_total += c->bytes;
+		}
+	}
+	printf("  %-16s %8zu B private, %zu B shared\n", "total", private_total, shared_total);
+
+#ifdef __GLIBC__
+#if __GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33)
+	struct mallinfo2 mi = mallinfo2();
+#else
+	struct mallinfo mi = mallinfo();
+#endif
+	printf("Heap: %zu B in use, %zu B mmapped, %zu B free\n",
+			(size_t)mi.uordblks, (size_t)mi.hblkhd, (size_t)mi.fordblks);
+#endif
+
+#ifdef __linux__
+	long rss = proc_kb_("/proc/self/status", "VmRSS");
+	long anon = proc_kb_("/proc/self/status", "RssAnon");
+	long file = proc_kb_("/proc/self/status", "RssFile");
+	long shmem = proc_kb_("/proc/self/status", "RssShmem");
+	long priv_clean = proc_kb_("/proc/self/smaps_rollup", "Private_Clean");
+	long priv_dirty = proc_kb_("/proc/self/smaps_rollup", "Private_Dirty");
+	printf("Process: RSS %ld kB (anon %ld kB, file %ld kB, shmem %ld kB)",
+			rss, anon, file, shmem);
+	if (priv_clean >= 0 && priv_dirty >= 0) {
+		printf(", private %ld kB", priv_clean + priv_dirty);
+	}
+	printf("\n");
+#else
+	printf("Process: RSS breakdown not available on this platform\n");
+#endif
+}
+
+/* Fill a freshly created object with the image, then publish the ready marker */
+static int fill_flash_object_(int fd, const uint8_t *flash, size_t size)
+{
+	size_t object_size = size + sizeof(struct flash_marker);
+	if (ftruncate(fd, object_size) < 0) {
+		perror("ftruncate");
+		return -1;
+	}
+	/* written through a mapping: not every platform supports write() on shm objects */
+	uint8_t *addr = mmap(NULL, object_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	memcpy(addr, flash, size);
+	struct flash_marker *marker = (struct flash_marker *)(addr + size);
+	marker->size = size;
+	__atomic_store_n(&marker->magic, FLASH_READY_MAGIC, __ATOMIC_RELEASE);
+	munmap(addr, object_size);
+	return 0;
+}
+
+/* Wait, for a bounded time, until the creator of an existing object has published it */
+static enum flash_object_state wait_flash_object_(int fd, size_t size)
+{
+	size_t object_size = size + sizeof(struct flash_marker);
+	uint8_t *addr = MAP_FAILED;
+
+	for (long waited_us = 0; waited_us < FLASH_READY_TIMEOUT_US; waited_us += FLASH_READY_POLL_US) {
+		if (addr == MAP_FAILED) {
+			struct stat st;
+			if (fstat(fd, &st) < 0) {
+				return FLASH_OBJECT_FOREIGN;
+			}
+			if ((size_t)st.st_size == object_size) {
+				addr = mmap(NULL, object_size, PROT_READ, MAP_SHARED, fd, 0);
+				if (addr == MAP_FAILED) {
+					return FLASH_OBJECT_FOREIGN;
+				}
+			} else if (st.st_size) {
+				/* creators size the object in one go: this holds a different image */
+				return FLASH_OBJECT_FOREIGN;
+			}
+		}
+		if (addr != MAP_FAILED) {
+			struct flash_marker *marker = (struct flash_marker *)(addr + size);
+			if (__atomic_load_n(&marker->magic, __ATOMIC_ACQUIRE) == FLASH_READY_MAGIC) {
+				bool same_size = marker->size == size;
+				munmap(addr, object_size);
+				return same_size ? FLASH_OBJECT_READY : FLASH_OBJECT_FOREIGN;
+			}
+		}
+		usleep(FLASH_READY_POLL_US);
+	}
+	if (addr != MAP_FAILED) {
+		munmap(addr, object_size);
+	}
+	return FLASH_OBJECT_STALE;
+}
+
+/* Unlink `name` only if it still refers to the stale object open as `fd` */
+static void unlink_stale_flash_object_(const char *name, int fd)
+{
+	struct stat stale, current;
+	int cur_fd = shm_open(name, O_RDONLY, 0);
+	if (cur_fd < 0) {
+		return;
+	}
+	if (!fstat(fd, &stale) && !fstat(cur_fd, &current) &&
+			stale.st_dev == current.st_dev && stale.st_ino == current.st_ino) {
+		shm_unlink(name);
+	}
+	close(cur_fd);
+}
+
+/*
+Replace the private flash image *flash of `size` bytes with a copy-on-write
+mapping of a shared copy. On failure *flash is left as it is.
+*/
+int arduboy_mem_share_flash(uint8_t **flash, size_t size)
+{
+	/* short enough for every platform, Darwin allows 31 characters */
+	char name[32];
+	snprintf(name, sizeof(name), "/sa-%016llx", (unsigned long long)fnv1a64_(*flash, size));
+
+	for (int attempt = 0; attempt < FLASH_SHARE_ATTEMPTS; attempt++) {
+		int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0444);
+		if (fd >= 0) {
+			/* first instance running this image: publish it */
+			if (fill_flash_object_(fd, *flash, size)) {
+				close(fd);
+				shm_unlink(name);
+				return -1;
+			}
+		} else if (errno == EEXIST) {
+			fd = shm_open(name, O_RDONLY, 0);
+			if (fd < 0 && errno == ENOENT) {
+				/* removed in the meantime, try creating it again */
+				continue;
+			}
+			if (fd < 0) {
+				perror("shm_open");
+				return -1;
+			}
+			enum flash_object_state state = wait_flash_object_(fd, size);
+			if (state == FLASH_OBJECT_STALE) {
+				/* its creator died before publishing it */
+				unlink_stale_flash_object_(name, fd);
+				close(fd);
+				continue;
+			}
+			if (state == FLASH_OBJECT_FOREIGN) {
+				fprintf(stderr, "Shared flash image %s holds another image, keeping a private copy\n", name);
+				close(fd);
+				return -1;
+			}
+		} else {
+			perror("shm_open");
+			return -1;
+		}
+
+		/* private mapping: SPM writes land in pages of our own */
+		void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		/* the mapping stays valid after the descriptor is closed */
+		close(fd);
+		if (addr == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		/* guard against a hash collision */
+		if (memcmp(addr, *flash, size)) {
+			fprintf(stderr, "Shared flash image %s holds another image, keeping a private copy\n", name);
+			munmap(addr, size);
+			return -1;
+		}
+
+		free(*flash);
+		*flash = addr;
+		mod_s.flash = addr;
+		mod_s.flash_size = size;
+		return 0;
+	}
+
+	fprintf(stderr, "Unable to publish shared flash image %s\n", name);
+	return -1;
+}
+
+bool arduboy_mem_flash_shared(void)
+{
+	return mod_s.flash != NULL;
+}
+
+/*
+The shared object is deliberately left in place for the next instance
+running the same ROM; objects are small and named after their content.
+*/
+void arduboy_mem_unshare_flash(void)
+{
+	if (!mod_s.flash) {
+		return;
+	}
+	munmap(mod_s.flash, mod_s.flash_size);
+	mod_s.flash = NULL;
+}
@@ -0,0 +1,36 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Memory owned by one part of a simulation instance */
+struct arduboy_mem_component {
+	const char *name;
+	size_t bytes;
+	/* backed by pages that other instances can share */
+	bool shared;
+};
+
+void arduboy_mem_report(const struct arduboy_mem_component *components, int count);
+int arduboy_mem_share_flash(uint8_t **flash, size_t size);
+bool arduboy_mem_flash_shared(void);
+void arduboy_mem_unshare_flash(void);
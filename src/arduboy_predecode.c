@@ -0,0 +1,727 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Pre-decoded instruction cache.
+
+Every flash word gets a 4 byte entry holding a handler id, its operands
+and its base cycle cost, decoded lazily the first time the word is
+executed. Execution then goes through the table with threaded dispatch
+(computed goto). Only instructions that touch nothing but registers,
+SREG and the PC are executed from the table: those cannot schedule
+cycle timers or raise interrupts, so the batch deadline only has to be
+refreshed after the others, which are handed to simavr's avr_run_one()
+one at a time. Semantics and cycle counts mirror sim_core.c and can be
+checked instruction by instruction against it with `verify`.
+
+Flash only changes through SPM (or a new image being loaded): an I/O
+module registered on top of simavr's flash controller sees every SPM
+request and drops the whole table.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_core.h>
+#include <sim_io.h>
+#include <avr_flash.h>
+
+#include "arduboy_predecode.h"
+#include "arduboy_run.h"
+
+
+enum predecode_op {
+	OP_DECODE = 0,
+	OP_FALLBACK,
+	OP_NOP,
+	OP_MOVW,
+	OP_CPC,
+	OP_SBC,
+	OP_ADD,
+	OP_CP,
+	OP_SUB,
+	OP_ADC,
+	OP_AND,
+	OP_EOR,
+	OP_OR,
+	OP_MOV,
+	OP_CPI,
+	OP_SBCI,
+	OP_SUBI,
+	OP_ORI,
+	OP_ANDI,
+	OP_LDI,
+	OP_RJMP,
+	OP_BRBS,
+	OP_BRBC,
+	OP_COM,
+	OP_NEG,
+	OP_SWAP,
+	OP_INC,
+	OP_ASR,
+	OP_LSR,
+	OP_ROR,
+	OP_DEC,
+	OP_ADIW,
+	OP_SBIW,
+	OP_COUNT,
+};
+
+struct predecode_entry {
+	uint8_t op;
+	uint8_t cycles;
+	union {
+		/* registers, 8 bit immediate, SREG bit and branch displacement */
+		struct {
+			uint8_t d;
+			uint8_t r;
+		};
+		/* RJMP displacement in bytes */
+		int16_t k;
+	};
+};
+
+struct predecode_cpu_state {
+	uint8_t regs[32];
+	uint8_t sreg[8];
+	avr_flashaddr_t pc;
+	avr_cycle_count_t cycle;
+};
+
+static struct mod_state {
+	avr_t *avr;
+	struct predecode_entry *table;
+	avr_flashaddr_t flash_size;
+	bool verify;
+	avr_io_t io;
+	uint64_t decoded;
+	uint64_t fallbacks;
+	uint64_t invalidations;
+} mod_s;
+
+
+static inline void flags_zns_(uint8_t *sreg, uint8_t res)
+{
+	sreg[S_Z] = res == 0;
+	sreg[S_N] = (res >> 7) & 1;
+	sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+static inline void flags_zns16_(uint8_t *sreg, uint16_t res)
+{
+	sreg[S_Z] = res == 0;
+	sreg[S_N] = (res >> 15) & 1;
+	sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+/* Z is only ever cleared, for multi byte compares and subtractions */
+static inline void flags_Rzns_(uint8_t *sreg, uint8_t res)
+{
+	if (res) {
+		sreg[S_Z] = 0;
+	}
+	sreg[S_N] = (res >> 7) & 1;
+	sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+static inline void flags_add_hcv_(uint8_t *sreg, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	uint8_t add_carry = (rd & rr) | (rr & ~res) | (~res & rd);
+	sreg[S_H] = (add_carry >> 3) & 1;
+	sreg[S_C] = (add_carry >> 7) & 1;
+	sreg[S_V] = (((rd & rr & ~res) | (~rd & ~rr & res)) >> 7) & 1;
+}
+
+static inline void flags_sub_hcv_(uint8_t *sreg, uint8_t res, uint8_t rd, uint8_t rr)
+{
+	uint8_t sub_carry = (~rd & rr) | (rr & res) | (res & ~rd);
+	sreg[S_H] = (sub_carry >> 3) & 1;
+	sreg[S_C] = (sub_carry >> 7) & 1;
+	sreg[S_V] = (((rd & ~rr & ~res) | (~rd & rr & res)) >> 7) & 1;
+}
+
+static inline void flags_znv0s_(uint8_t *sreg, uint8_t res)
+{
+	sreg[S_V] = 0;
+	flags_zns_(sreg, res);
+}
+
+static inline void flags_zcnvs_(uint8_t *sreg, uint8_t res, uint8_t rd)
+{
+	sreg[S_Z] = res == 0;
+	sreg[S_C] = rd & 1;
+	sreg[S_N] = (res >> 7) & 1;
+	sreg[S_V] = sreg[S_N] ^ sreg[S_C];
+	sreg[S_S] = sreg[S_N] ^ sreg[S_V];
+}
+
+static void decode_(avr_t *avr, avr_flashaddr_t pc, struct predecode_entry *e)
+{
+	uint16_t opcode = avr->flash[pc] | (avr->flash[pc + 1] << 8);
+	/* Rd, Rr (0-31); Rd (16-31), K (8 bit) */
+	uint8_t d5 = (opcode >> 4) & 0x1f;
+	uint8_t r5 = ((opcode >> 5) & 0x10) | (opcode & 0xf);
+	uint8_t h4 = 16 + ((opcode >> 4) & 0xf);
+	uint8_t k8 = ((opcode & 0xf00) >> 4) | (opcode & 0xf);
+	uint8_t op = OP_FALLBACK;
+
+	e->cycles = 1;
+	e->d = d5;
+	e->r = r5;
+	mod_s.decoded++;
+
+	if (pc >= avr->codeend) {
+		/* let the reference core crash */
+		e->op = OP_FALLBACK;
+		return;
+	}
+
+	switch (opcode & 0xf000) {
+		case 0x0000:
+			if (opcode == 0x0000) {
+				op = OP_NOP;
+			} else if ((opcode & 0xff00) == 0x0100) {
+				op = OP_MOVW;
+				e->d = ((opcode >> 4) & 0xf) << 1;
+				e->r = (opcode & 0xf) << 1;
+			} else if ((opcode & 0xfc00) == 0x0400) {
+				op = OP_CPC;
+			} else if ((opcode & 0xfc00) == 0x0800) {
+				op = OP_SBC;
+			} else if ((opcode & 0xfc00) == 0x0c00) {
+				op = OP_ADD;
+			}
+			break;
+		case 0x1000:
+			switch (opcode & 0xfc00) {
+				case 0x1400: op = OP_CP; break;
+				case 0x1800: op = OP_SUB; break;
+				case 0x1c00: op = OP_ADC; break;
+			}
+			break;
+		case 0x2000:
+			switch (opcode & 0xfc00) {
+				case 0x2000: op = OP_AND; break;
+				case 0x2400: op = OP_EOR; break;
+				case 0x2800: op = OP_OR; break;
+				case 0x2c00: op = OP_MOV; break;
+			}
+			break;
+		case 0x3000: op = OP_CPI; break;
+		case 0x4000: op = OP_SBCI; break;
+		case 0x5000: op = OP_SUBI; break;
+		case 0x6000: op = OP_ORI; break;
+		case 0x7000: op = OP_ANDI; break;
+		case 0xe000: op = OP_LDI; break;
+		case 0xc000:
+			op = OP_RJMP;
+			e->cycles = 2;
+			e->k = ((int16_t)(opcode << 4)) >> 3;
+			break;
+		case 0xf000:
+			if ((opcode & 0xf800) == 0xf000) {
+				op = (opcode & 0x0400) ? OP_BRBC : OP_BRBS;
+				e->d = opcode & 7;
+				e->r = (uint8_t)((((int16_t)(opcode << 6)) >> 9) * 2);
+			}
+			break;
+		case 0x9000:
+			switch (opcode & 0xfe0f) {
+				case 0x9400: op = OP_COM; break;
+				case 0x9401: op = OP_NEG; break;
+				case 0x9402: op = OP_SWAP; break;
+				case 0x9403: op = OP_INC; break;
+				case 0x9405: op = OP_ASR; break;
+				case 0x9406: op = OP_LSR; break;
+				case 0x9407: op = OP_ROR; break;
+				case 0x940a: op = OP_DEC; break;
+			}
+			if ((opcode & 0xfe00) == 0x9600) {
+				op = (opcode & 0x0100) ? OP_SBIW : OP_ADIW;
+				e->cycles = 2;
+				e->d = 24 + ((opcode >> 3) & 0x6);
+				e->r = ((opcode & 0xc0) >> 2) | (opcode & 0xf);
+			}
+			break;
+	}
+
+	if (op >= OP_CPI && op <= OP_LDI) {
+		e->d = h4;
+		e->r = k8;
+	}
+	e->op = op;
+}
+
+static inline void save_state_(avr_t *avr, struct predecode_cpu_state *state)
+{
+	memcpy(state->regs, avr->data, sizeof(state->regs));
+	memcpy(state->sreg, avr->sreg, sizeof(state->sreg));
+	state->pc = avr->pc;
+	state->cycle = avr->cycle;
+}
+
+static inline void restore_state_(avr_t *avr, const struct predecode_cpu_state *state)
+{
+	memcpy(avr->data, state->regs, sizeof(state->regs));
+	memcpy(avr->sreg, state->sreg, sizeof(state->sreg));
+	avr->pc = state->pc;
+	avr->cycle = state->cycle;
+}
+
+/*
+Execute the instruction that was just run from the table again with
+the reference core, starting from the same state, and compare results.
+The reference results are kept. Returns -1 on mismatch.
+*/
+static int verify_(avr_t *avr, const struct predecode_cpu_state *pre, avr_flashaddr_t *new_pc)
+{
+	struct predecode_cpu_state fast, ref;
+
+	save_state_(avr, &fast);
+	fast.pc = *new_pc;
+	restore_state_(avr, pre);
+	/* exactly one instruction */
+	avr->run_cycle_count = 0;
+	*new_pc = avr_run_one(avr);
+	save_state_(avr, &ref);
+	ref.pc = *new_pc;
+
+	if (memcmp(fast.regs, ref.regs, sizeof(ref.regs)) ||
+			memcmp(fast.sreg, ref.sreg, sizeof(ref.sreg)) ||
+			fast.pc != ref.pc || fast.cycle != ref.cycle) {
+		uint16_t opcode = avr->flash[pre->pc] | (avr->flash[pre->pc + 1] << 8);
+		AVR_LOG(avr, LOG_ERROR, "predecode: mismatch at pc 0x%04x opcode 0x%04x\n", pre->pc, opcode);
+		avr->state = cpu_Crashed;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+Run instructions until the next cycle timer is due, an interrupt
+becomes serviceable or the CPU state changes. Like avr_run_one() the PC
+of the last instruction executed is returned rather than stored.
+*/
+avr_flashaddr_t arduboy_predecode_run(avr_t *avr)
+{
+	static const void *const handlers[OP_COUNT] = {
+		[OP_DECODE] = &&op_decode,
+		[OP_FALLBACK] = &&op_fallback,
+		[OP_NOP] = &&op_nop,
+		[OP_MOVW] = &&op_movw,
+		[OP_CPC] = &&op_cpc,
+		[OP_SBC] = &&op_sbc,
+		[OP_ADD] = &&op_add,
+		[OP_CP] = &&op_cp,
+		[OP_SUB] = &&op_sub,
+		[OP_ADC] = &&op_adc,
+		[OP_AND] = &&op_and,
+		[OP_EOR] = &&op_eor,
+		[OP_OR] = &&op_or,
+		[OP_MOV] = &&op_mov,
+		[OP_CPI] = &&op_cpi,
+		[OP_SBCI] = &&op_sbci,
+		[OP_SUBI] = &&op_subi,
+		[OP_ORI] = &&op_ori,
+		[OP_ANDI] = &&op_andi,
+		[OP_LDI] = &&op_ldi,
+		[OP_RJMP] = &&op_rjmp,
+		[OP_BRBS] = &&op_brbs,
+		[OP_BRBC] = &&op_brbc,
+		[OP_COM] = &&op_com,
+		[OP_NEG] = &&op_neg,
+		[OP_SWAP] = &&op_swap,
+		[OP_INC] = &&op_inc,
+		[OP_ASR] = &&op_asr,
+		[OP_LSR] = &&op_lsr,
+		[OP_ROR] = &&op_ror,
+		[OP_DEC] = &&op_dec,
+		[OP_ADIW] = &&op_adiw,
+		[OP_SBIW] = &&op_sbiw,
+	};
+	const avr_flashaddr_t flash_size = mod_s.flash_size;
+	const bool verify = mod_s.verify;
+	uint8_t *regs = avr->data;
+	uint8_t *sreg = avr->sreg;
+	avr_cycle_count_t deadline = arduboy_run_deadline(avr);
+	struct predecode_cpu_state pre;
+	struct predecode_entry *e;
+	avr_flashaddr_t new_pc;
+	uint8_t vd, vr, res;
+	uint16_t vd16, res16;
+
+	if (avr->pc >= flash_size) {
+		return avr_run_one(avr);
+	}
+
+#define DISPATCH() do { \
+		e = &mod_s.table[avr->pc >> 1]; \
+		if (verify && e->op > OP_FALLBACK) { \
+			save_state_(avr, &pre); \
+		} \
+		goto *handlers[e->op]; \
+	} while (0)
+
+#define RETIRE() do { \
+		avr->cycle += e->cycles; \
+		if (verify && verify_(avr, &pre, &new_pc)) { \
+			return new_pc; \
+		} \
+		if (avr->cycle >= deadline || (avr->interrupt_state && sreg[S_I]) || new_pc >= flash_size) { \
+			return new_pc; \
+		} \
+		avr->pc = new_pc; \
+		DISPATCH(); \
+	} while (0)
+
+	DISPATCH();
+
+op_decode:
+	decode_(avr, avr->pc, e);
+	DISPATCH();
+
+op_fallback:
+	/* exactly one instruction, then back to the table */
+	avr->run_cycle_count = 0;
+	new_pc = avr_run_one(avr);
+	mod_s.fallbacks++;
+	if (avr->state != cpu_Running || (avr->interrupt_state && sreg[S_I]) || new_pc >= flash_size) {
+		return new_pc;
+	}
+	/* I/O may have scheduled cycle timers */
+	deadline = arduboy_run_deadline(avr);
+	if (avr->cycle >= deadline) {
+		return new_pc;
+	}
+	avr->pc = new_pc;
+	DISPATCH();
+
+op_nop:
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_movw:
+	regs[e->d] = regs[e->r];
+	regs[e->d + 1] = regs[e->r + 1];
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_cpc:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd - vr - sreg[S_C];
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_Rzns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_sbc:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd - vr - sreg[S_C];
+	regs[e->d] = res;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_Rzns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_add:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd + vr;
+	regs[e->d] = res;
+	flags_add_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_cp:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd - vr;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_sub:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd - vr;
+	regs[e->d] = res;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_adc:
+	vd = regs[e->d];
+	vr = regs[e->r];
+	res = vd + vr + sreg[S_C];
+	regs[e->d] = res;
+	flags_add_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_and:
+	res = regs[e->d] & regs[e->r];
+	regs[e->d] = res;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_eor:
+	res = regs[e->d] ^ regs[e->r];
+	regs[e->d] = res;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_or:
+	res = regs[e->d] | regs[e->r];
+	regs[e->d] = res;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_mov:
+	regs[e->d] = regs[e->r];
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_cpi:
+	vd = regs[e->d];
+	vr = e->r;
+	res = vd - vr;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_sbci:
+	vd = regs[e->d];
+	vr = e->r;
+	res = vd - vr - sreg[S_C];
+	regs[e->d] = res;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_Rzns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_subi:
+	vd = regs[e->d];
+	vr = e->r;
+	res = vd - vr;
+	regs[e->d] = res;
+	flags_sub_hcv_(sreg, res, vd, vr);
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_ori:
+	res = regs[e->d] | e->r;
+	regs[e->d] = res;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_andi:
+	res = regs[e->d] & e->r;
+	regs[e->d] = res;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_ldi:
+	regs[e->d] = e->r;
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_rjmp:
+	new_pc = (avr->pc + 2 + e->k) % (avr->flashend + 1);
+	RETIRE();
+
+op_brbs:
+	new_pc = avr->pc + 2;
+	if (sreg[e->d]) {
+		avr->cycle++;
+		new_pc += (int8_t)e->r;
+	}
+	RETIRE();
+
+op_brbc:
+	new_pc = avr->pc + 2;
+	if (!sreg[e->d]) {
+		avr->cycle++;
+		new_pc += (int8_t)e->r;
+	}
+	RETIRE();
+
+op_com:
+	res = 0xff - regs[e->d];
+	regs[e->d] = res;
+	sreg[S_C] = 1;
+	flags_znv0s_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_neg:
+	vd = regs[e->d];
+	res = 0x00 - vd;
+	regs[e->d] = res;
+	sreg[S_H] = ((res >> 3) | (vd >> 3)) & 1;
+	sreg[S_V] = res == 0x80;
+	sreg[S_C] = res != 0;
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_swap:
+	vd = regs[e->d];
+	regs[e->d] = (vd >> 4) | (vd << 4);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_inc:
+	res = regs[e->d] + 1;
+	regs[e->d] = res;
+	sreg[S_V] = res == 0x80;
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_asr:
+	vd = regs[e->d];
+	res = (vd >> 1) | (vd & 0x80);
+	regs[e->d] = res;
+	flags_zcnvs_(sreg, res, vd);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_lsr:
+	vd = regs[e->d];
+	res = vd >> 1;
+	regs[e->d] = res;
+	flags_zcnvs_(sreg, res, vd);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_ror:
+	vd = regs[e->d];
+	res = (sreg[S_C] ? 0x80 : 0) | vd >> 1;
+	regs[e->d] = res;
+	flags_zcnvs_(sreg, res, vd);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_dec:
+	res = regs[e->d] - 1;
+	regs[e->d] = res;
+	sreg[S_V] = res == 0x7f;
+	flags_zns_(sreg, res);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_adiw:
+	vd16 = regs[e->d] | (regs[e->d + 1] << 8);
+	res16 = vd16 + e->r;
+	regs[e->d] = res16;
+	regs[e->d + 1] = res16 >> 8;
+	sreg[S_V] = ((~vd16 & res16) >> 15) & 1;
+	sreg[S_C] = ((~res16 & vd16) >> 15) & 1;
+	flags_zns16_(sreg, res16);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+op_sbiw:
+	vd16 = regs[e->d] | (regs[e->d + 1] << 8);
+	res16 = vd16 - e->r;
+	regs[e->d] = res16;
+	regs[e->d + 1] = res16 >> 8;
+	sreg[S_V] = ((vd16 & ~res16) >> 15) & 1;
+	sreg[S_C] = ((res16 & ~vd16) >> 15) & 1;
+	flags_zns16_(sreg, res16);
+	new_pc = avr->pc + 2;
+	RETIRE();
+
+#undef RETIRE
+#undef DISPATCH
+}
+
+void arduboy_predecode_invalidate(void)
+{
+	if (mod_s.table) {
+		memset(mod_s.table, 0, (mod_s.flash_size >> 1) * sizeof(struct predecode_entry));
+		mod_s.invalidations++;
+	}
+}
+
+/* Sits in front of the flash controller in the I/O module list */
+static int predecode_ioctl(struct avr_io_t *io, uint32_t ctl, void *io_param)
+{
+	if (ctl == AVR_IOCTL_FLASH_SPM) {
+		/* flash is about to change, let the flash controller handle the request */
+		arduboy_predecode_invalidate();
+	}
+	return -1;
+}
+
+int arduboy_predecode_init(avr_t *avr, bool verify)
+{
+	memset(&mod_s, 0, sizeof(mod_s));
+	mod_s.avr = avr;
+	mod_s.verify = verify;
+	mod_s.flash_size = avr->flashend + 1;
+	mod_s.table = calloc(mod_s.flash_size >> 1, sizeof(struct predecode_entry));
+	if (!mod_s.table) {
+		return -1;
+	}
+	mod_s.io.kind = "predecode";
+	mod_s.io.ioctl = predecode_ioctl;
+	avr_register_io(avr, &mod_s.io);
+	return 0;
+}
+
+void arduboy_predecode_report(void)
+{
+	if (!mod_s.table) {
+		return;
+	}
+	printf("Predecode: %llu words decoded, %llu fallbacks to the reference core, %llu invalidations\n",
+			(unsigned long long)mod_s.decoded, (unsigned long long)mod_s.fallbacks,
+			(unsigned long long)mod_s.invalidations);
+}
+
+/* Entries are decoded on first use, so pages covering code that never runs may stay untouched */
+size_t arduboy_predecode_mem_size(void)
+{
+	if (!mod_s.table) {
+		return 0;
+	}
+	return (mod_s.flash_size >> 1) * sizeof(struct predecode_entry);
+}
+
+void arduboy_predecode_teardown(void)
+{
+	free(mod_s.table);
+	mod_s.table = NULL;
+}
@@ -0,0 +1,31 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct avr_t;
+
+int arduboy_predecode_init(struct avr_t *avr, bool verify);
+uint32_t arduboy_predecode_run(struct avr_t *avr);
+void arduboy_predecode_invalidate(void);
+void arduboy_predecode_report(void);
+size_t arduboy_predecode_mem_size(void);
+void arduboy_predecode_teardown(void);
@@ -0,0 +1,342 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Frame presentation.
+
+By default every frame is drawn and swapped from the simulation thread
+as soon as the render timer produces it, which paces frames by simulated
+time and beats against the host display refresh.
+
+Once arduboy_present_start() has been called (-V), the simulation thread
+only publishes frames, one per SSD1306 frame period, into a small ring
+of seqlock protected slots and never waits on the display. A render
+thread owning the GL context swaps with vsync and, at each refresh,
+advances its own presentation clock by a whole number of refresh periods
+and draws the luma blend of the two published frames around it. The
+clock is kept inside the window of published frames, so frames are
+repeated when the simulation falls behind and skipped when it runs
+ahead, without ever stalling either side.
+
+In both modes the time between swaps and its deviation from the amount
+of simulated time shown are accumulated as pacing statistics.
+*/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+#include "arduboy_present.h"
+#include "arduboy_sdl.h"
+#include "ssd1306_gl.h"
+
+
+/* the slot after the newest one may be being rewritten, the others are readable */
+#define RING_SLOTS (4)
+#define DEFAULT_REFRESH_HZ (60)
+/* give up on reading a slot the writer keeps lapping */
+#define READ_RETRIES (4)
+
+struct present_slot {
+	/* seqlock: odd while the slot is being written */
+	uint32_t seq;
+	/* publication number of the frame held */
+	uint64_t n;
+	uint64_t sim_time_ns;
+	struct ssd1306_gl_frame frame;
+};
+
+/* Running mean and variance (Welford) */
+struct present_stat {
+	uint64_t count;
+	double mean;
+	double m2;
+};
+
+static struct mod_state {
+	SDL_Window *window;
+	SDL_GLContext gl_context;
+	SDL_Thread *thread;
+	SDL_atomic_t quit;
+	int refresh_hz;
+	bool vsync;
+	/* written by the simulation thread */
+	uint64_t published;
+	struct present_slot ring[RING_SLOTS];
+	/* owned by whoever draws */
+	struct ssd1306_gl_frame frame[2];
+	struct ssd1306_gl_frame shown;
+	uint64_t target_ns;
+	uint64_t last_used;
+	uint64_t last_wall_ns;
+	uint64_t last_sim_ns;
+	uint64_t repeated;
+	uint64_t dropped;
+	struct present_stat frame_time;
+	struct present_stat pacing_error;
+} mod_s;
+
+
+static uint64_t wall_time_ns(void)
+{
+	return SDL_GetPerformanceCounter() * 1e9 / SDL_GetPerformanceFrequency();
+}
+
+static void stat_add_(struct present_stat *stat, double value)
+{
+	stat->count++;
+	double delta = value - stat->mean;
+	stat->mean += delta / stat->count;
+	stat->m2 += delta * (value - stat->mean);
+}
+
+static double stat_stddev_(const struct present_stat *stat)
+{
+	return stat->count > 1 ? sqrt(stat->m2 / (stat->count - 1)) : 0.0;
+}
+
+/* Account for a frame showing simulated time sim_ns that was just swapped in */
+static void account_(uint64_t sim_ns)
+{
+	uint64_t wall_ns = wall_time_ns();
+	if (mod_s.last_wall_ns) {
+		double frame_ns = wall_ns - mod_s.last_wall_ns;
+		double content_ns = (double)sim_ns - mod_s.last_sim_ns;
+		stat_add_(&mod_s.frame_time, frame_ns);
+		stat_add_(&mod_s.pacing_error, content_ns - frame_ns);
+		if (sim_ns == mod_s.last_sim_ns) {
+			mod_s.repeated++;
+		}
+	}
+	mod_s.last_wall_ns = wall_ns;
+	mod_s.last_sim_ns = sim_ns;
+}
+
+/*
+Copy the time of frame `n`, and the frame itself when `frame` is set.
+Fails if its slot was being rewritten or already holds a later frame.
+*/
+static bool read_slot_(uint64_t n, uint64_t *sim_time_ns, struct ssd1306_gl_frame *frame)
+{
+	struct present_slot *slot = &mod_s.ring[n % RING_SLOTS];
+	for (int retry = 0; retry < READ_RETRIES; retry++) {
+		uint32_t s1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (s1 & 1) {
+			continue;
+		}
+		uint64_t slot_n = slot->n;
+		*sim_time_ns = slot->sim_time_ns;
+		if (frame) {
+			memcpy(frame, &slot->frame, sizeof(*frame));
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == s1) {
+			return slot_n == n;
+		}
+	}
+	return false;
+}
+
+/* out = a blended towards b by `weight`/256, display flags and contrast from the nearest of the two */
+static void blend_(struct ssd1306_gl_frame *out, const struct ssd1306_gl_frame *a,
+		const struct ssd1306_gl_frame *b, uint32_t weight)
+{
+	int size = a->columns*a->rows;
+	memcpy(out, weight < 128 ? a : b, sizeof(*out) - sizeof(out->luma));
+	for (int i = 0; i < size; i++) {
+		out->luma[i] = a->luma[i] + (((int32_t)b->luma[i] - a->luma[i]) * (int32_t)weight >> 8);
+	}
+}
+
+/*
+Prepare the frame to show at the next refresh, `step_ns` after the
+previous one. Returns false, leaving the previous frame in place, when
+nothing new could be read.
+*/
+static bool update_frame_(uint64_t step_ns)
+{
+	uint64_t published = __atomic_load_n(&mod_s.published, __ATOMIC_ACQUIRE);
+	if (!published) {
+		return false;
+	}
+
+	uint64_t oldest = published > RING_SLOTS - 1 ? published - (RING_SLOTS - 1) : 0;
+	uint64_t newest = published - 1;
+	uint64_t oldest_ns, newest_ns;
+	if (!read_slot_(oldest, &oldest_ns, NULL) || !read_slot_(newest, &newest_ns, NULL)) {
+		return false;
+	}
+
+	/* start half way through the window, then advance by whole refresh periods */
+	uint64_t target = mod_s.target_ns ? mod_s.target_ns + step_ns : newest_ns - (newest_ns - oldest_ns)/2;
+	if (target > newest_ns) {
+		target = newest_ns;
+	} else if (target < oldest_ns) {
+		target = oldest_ns;
+	}
+	mod_s.target_ns = target;
+
+	/* latest frame at or before the target, unless the writer has moved past it meanwhile */
+	uint64_t a = newest, a_ns = newest_ns;
+	while (a_ns > target) {
+		if (a == oldest) {
+			return false;
+		}
+		a--;
+		if (!read_slot_(a, &a_ns, NULL)) {
+			return false;
+		}
+	}
+
+	uint64_t t;
+	if (!read_slot_(a, &t, &mod_s.frame[0]) || t != a_ns) {
+		return false;
+	}
+	uint64_t used = a;
+	if (target > a_ns) {
+		/* a < newest here, blend with the frame that follows */
+		if (!read_slot_(a + 1, &t, &mod_s.frame[1]) || t <= a_ns) {
+			return false;
+		}
+		blend_(&mod_s.shown, &mod_s.frame[0], &mod_s.frame[1], (target - a_ns) * 256 / (t - a_ns));
+		used = a + 1;
+	} else {
+		memcpy(&mod_s.shown, &mod_s.frame[0], sizeof(mod_s.shown));
+	}
+	if (mod_s.last_used && a > mod_s.last_used + 1) {
+		mod_s.dropped += a - mod_s.last_used - 1;
+	}
+	mod_s.last_used = used;
+	return true;
+}
+
+static int present_thread(void *data)
+{
+	uint64_t period_ns = 1000000000ULL / mod_s.refresh_hz;
+	uint64_t step_ns = 0;
+	uint64_t last_swap_ns = 0;
+
+	SDL_GL_MakeCurrent(mod_s.window, mod_s.gl_context);
+	mod_s.vsync = SDL_GL_SetSwapInterval(1) == 0;
+
+	while (!SDL_AtomicGet(&mod_s.quit)) {
+		bool fresh = update_frame_(step_ns);
+		ssd1306_gl_render(&mod_s.shown);
+		if (!mod_s.vsync && last_swap_ns) {
+			/* no vsync available: pace swaps on our own */
+			uint64_t elapsed_ns = wall_time_ns() - last_swap_ns;
+			if (elapsed_ns < period_ns) {
+				SDL_Delay((period_ns - elapsed_ns) / 1000000);
+			}
+		}
+		SDL_GL_SwapWindow(mod_s.window);
+		uint64_t swap_ns = wall_time_ns();
+		if (fresh) {
+			account_(mod_s.target_ns);
+		}
+
+		/* missed refreshes still count towards the presentation clock */
+		uint64_t refreshes = last_swap_ns ? (swap_ns - last_swap_ns + period_ns/2) / period_ns : 1;
+		step_ns = (refreshes ? refreshes : 1) * period_ns;
+		last_swap_ns = swap_ns;
+	}
+
+	SDL_GL_MakeCurrent(mod_s.window, NULL);
+	return 0;
+}
+
+/*
+Hand the GL context over to a render thread synchronised to the refresh
+rate of the display showing the window.
+*/
+int arduboy_present_start(void *sdl_window, void *sdl_gl_context)
+{
+	SDL_DisplayMode mode;
+
+	mod_s.window = sdl_window;
+	mod_s.gl_context = sdl_gl_context;
+	mod_s.refresh_hz = DEFAULT_REFRESH_HZ;
+	if (!SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(mod_s.window), &mode) && mode.refresh_rate > 0) {
+		mod_s.refresh_hz = mode.refresh_rate;
+	}
+
+	/* the context can only be current in one thread at a time */
+	SDL_GL_MakeCurrent(mod_s.window, NULL);
+	SDL_AtomicSet(&mod_s.quit, 0);
+	mod_s.thread = SDL_CreateThread(present_thread, "present", NULL);
+	if (!mod_s.thread) {
+		fprintf(stderr, "Unable to start render thread: %s\n", SDL_GetError());
+		SDL_GL_MakeCurrent(mod_s.window, mod_s.gl_context);
+		return -1;
+	}
+	return 0;
+}
+
+/* Called by the simulation thread with each new luma frame */
+void arduboy_present_frame(struct ssd1306_t *ssd1306, const uint8_t *luma_pixmap, uint64_t sim_time_ns)
+{
+	if (!mod_s.thread) {
+		ssd1306_gl_capture(&mod_s.frame[0], ssd1306, luma_pixmap);
+		ssd1306_gl_render(&mod_s.frame[0]);
+		arduboy_sdl_render_frame();
+		account_(sim_time_ns);
+		return;
+	}
+
+	/* only this thread writes published, a relaxed load is enough */
+	uint64_t n = __atomic_load_n(&mod_s.published, __ATOMIC_RELAXED);
+	struct present_slot *slot = &mod_s.ring[n % RING_SLOTS];
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->n = n;
+	slot->sim_time_ns = sim_time_ns;
+	ssd1306_gl_capture(&slot->frame, ssd1306, luma_pixmap);
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&mod_s.published, n + 1, __ATOMIC_RELEASE);
+}
+
+void arduboy_present_report(void)
+{
+	if (mod_s.frame_time.count < 2) {
+		return;
+	}
+	if (mod_s.thread) {
+		printf("Presentation: vsync%s at %d Hz, %llu repeated, %llu skipped\n",
+				mod_s.vsync ? "" : " (emulated)", mod_s.refresh_hz,
+				(unsigned long long)mod_s.repeated, (unsigned long long)mod_s.dropped);
+	} else {
+		printf("Presentation: render timer, %llu repeated\n", (unsigned long long)mod_s.repeated);
+	}
+	printf("  frame time: mean %.3f ms, stddev %.3f ms; pacing error: mean %.3f ms, stddev %.3f ms\n",
+			mod_s.frame_time.mean / 1e6, stat_stddev_(&mod_s.frame_time) / 1e6,
+			mod_s.pacing_error.mean / 1e6, stat_stddev_(&mod_s.pacing_error) / 1e6);
+}
+
+void arduboy_present_stop(void)
+{
+	if (!mod_s.thread) {
+		return;
+	}
+	SDL_AtomicSet(&mod_s.quit, 1);
+	SDL_WaitThread(mod_s.thread, NULL);
+	/* keep mod_s.thread set: the statistics refer to the render thread */
+	SDL_GL_MakeCurrent(mod_s.window, mod_s.gl_context);
+}
@@ -0,0 +1,27 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+struct ssd1306_t;
+
+int arduboy_present_start(void *sdl_window, void *sdl_gl_context);
+void arduboy_present_frame(struct ssd1306_t *ssd1306, const uint8_t *luma_pixmap, uint64_t sim_time_ns);
+void arduboy_present_report(void);
+void arduboy_present_stop(void);
@@ -0,0 +1,32 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sim_avr.h>
+#include <sim_cycle_timers.h>
+
+/*
+Cycle at which a batch of instructions must stop so that cycle timers
+fire exactly when the reference loop would fire them. Shared by every
+batched run path so their deadlines can never disagree.
+*/
+static inline avr_cycle_count_t arduboy_run_deadline(avr_t *avr)
+{
+	avr_cycle_timer_slot_p timer = avr->cycle_timers.timer;
+	return timer ? timer->when : avr->cycle + avr->run_cycle_limit;
+}
@@ -24,6 +24,7 @@
 #include "sim_arduboy.h"
 #include "arduboy_sdl.h"
 #include "arduboy_avr.h"
+#include "arduboy_present.h"
 
 
 static struct mod_state {
@@ -107,6 +108,9 @@ int arduboy_sdl_setup(struct sim_arduboy_opts *opts)
 	assert(mod_s.sdl_window != NULL);
 	mod_s.sdl_gl_context = SDL_GL_CreateContext(mod_s.sdl_window);
 	assert(mod_s.sdl_gl_context != NULL);
+	if (opts->vsync) {
+		return arduboy_present_start(mod_s.sdl_window, mod_s.sdl_gl_context);
+	}
 	return 0;
 }
 
@@ -144,6 +148,7 @@ int arduboy_sdl_loop(void)
 
 void arduboy_sdl_teardown(void)
 {
+	arduboy_present_stop();
 	SDL_DestroyWindow(mod_s.sdl_window);
 	SDL_Quit();
 }
@@ -0,0 +1,514 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Simulation server.
+
+A single event loop accepts clients on a Unix domain socket and
+multiplexes them with epoll until they ask for a ROM to be loaded. Each
+session then runs in its own worker process, forked from a pool of at
+most `max_sessions` workers, which takes over the client connection and
+drives the simulation with arduboy_avr_setup()/arduboy_avr_loop(). The
+simulator modules keep their state in module globals, so a process per
+session is what lets sessions run side by side; it also guarantees no
+session can ever block the event loop.
+*/
+
+/* accept4() */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+#include "sim_arduboy.h"
+#include "arduboy_avr.h"
+#include "arduboy_server.h"
+#include "ssd1306_luma.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+
+#define MAX_EVENTS (32)
+
+struct server_conn {
+	int fd;
+	uint32_t rx_len;
+	struct server_conn *next;
+	struct arduboy_server_msg req;
+	char path[PATH_MAX];
+};
+
+static struct mod_state {
+	struct sim_arduboy_opts *opts;
+	int listen_fd;
+	int epoll_fd;
+	int signal_fd;
+	struct server_conn *conns;
+	pid_t *workers;
+	int worker_count;
+} mod_s;
+
+
+static int read_full_(int fd, void *buf, size_t len)
+{
+	uint8_t *ptr = buf;
+	while (len) {
+		ssize_t n = read(fd, ptr, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_full_(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = buf;
+	while (len) {
+		ssize_t n = write(fd, ptr, len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+		ptr += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int worker_reply_(int fd, uint8_t op, uint8_t status, uint32_t arg,
+		const void *hdr, uint32_t hdr_len, const void *payload, uint32_t payload_len)
+{
+	struct arduboy_server_msg rsp = {
+		.op = op,
+		.status = status,
+		.arg = arg,
+		.len = hdr_len + payload_len,
+	};
+	if (write_full_(fd, &rsp, sizeof(rsp))) {
+		return -1;
+	}
+	if (hdr_len && write_full_(fd, hdr, hdr_len)) {
+		return -1;
+	}
+	if (payload_len && write_full_(fd, payload, payload_len)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int worker_get_frame_(int fd, uint8_t op)
+{
+	struct arduboy_avr_status status;
+	arduboy_avr_get_status(&status);
+	struct arduboy_server_frame frame = {
+		.frame = status.frame,
+		.cycle = status.cycle,
+		.buttons = status.buttons,
+	};
+	return worker_reply_(fd, op, ARDUBOY_SERVER_OK, 0,
+			&frame, sizeof(frame), ssd1306_luma_pixmap(), OLED_WIDTH_PX*OLED_HEIGHT_PX);
+}
+
+static int worker_snapshot_(int fd, uint8_t op)
+{
+	struct arduboy_avr_status status;
+	arduboy_avr_get_status(&status);
+	uint32_t data_size;
+	const uint8_t *data = arduboy_avr_data(&data_size);
+	struct arduboy_server_snapshot snapshot = {
+		.cycle = status.cycle,
+		.pc = status.pc,
+		.sreg = status.sreg,
+		.state = status.state,
+		.data_size = data_size,
+	};
+	return worker_reply_(fd, op, ARDUBOY_SERVER_OK, 0,
+			&snapshot, sizeof(snapshot), data, data_size);
+}
+
+/* Serve requests until the session is closed, returns -1 if the client went away */
+static int worker_serve_(int fd)
+{
+	struct arduboy_server_msg req;
+	while (!read_full_(fd, &req, sizeof(req))) {
+		int ret;
+		if (req.len) {
+			/* only LOAD_ROM carries a payload */
+			worker_reply_(fd, req.op, ARDUBOY_SERVER_BAD_REQUEST, 0, NULL, 0, NULL, 0);
+			return -1;
+		}
+		switch (req.op) {
+			case ARDUBOY_SERVER_SET_BUTTONS:
+				arduboy_avr_set_buttons(req.arg);
+				ret = worker_reply_(fd, req.op, ARDUBOY_SERVER_OK, 0, NULL, 0, NULL, 0);
+				break;
+			case ARDUBOY_SERVER_STEP_FRAMES: {
+				uint32_t frames = 0;
+				while (frames < req.arg && !arduboy_avr_loop()) {
+					frames++;
+				}
+				ret = worker_reply_(fd, req.op, ARDUBOY_SERVER_OK, frames, NULL, 0, NULL, 0);
+				break;
+			}
+			case ARDUBOY_SERVER_GET_FRAME:
+				ret = worker_get_frame_(fd, req.op);
+				break;
+			case ARDUBOY_SERVER_SNAPSHOT:
+				ret = worker_snapshot_(fd, req.op);
+				break;
+			case ARDUBOY_SERVER_CLOSE:
+				worker_reply_(fd, req.op, ARDUBOY_SERVER_OK, 0, NULL, 0, NULL, 0);
+				return 0;
+			default:
+				ret = worker_reply_(fd, req.op, ARDUBOY_SERVER_BAD_REQUEST, 0, NULL, 0, NULL, 0);
+				break;
+		}
+		if (ret) {
+			return -1;
+		}
+	}
+	return -1;
+}
+
+static void worker_main_(struct server_conn *conn)
+{
+	int fd = conn->fd;
+
+	/* the session only needs its own connection */
+	close(mod_s.listen_fd);
+	close(mod_s.epoll_fd);
+	close(mod_s.signal_fd);
+	for (struct server_conn *c = mod_s.conns; c; c = c->next) {
+		if (c != conn) {
+			close(c->fd);
+		}
+	}
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigprocmask(SIG_SETMASK, &mask, NULL);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+	struct sim_arduboy_opts opts = *mod_s.opts;
+	opts.hex_file_path = conn->path;
+	opts.debug = false;
+	opts.headless = true;
+	opts.unthrottled = true;
+	opts.shm_name = NULL;
+	opts.analyzer_log = NULL;
+	opts.vsync = false;
+
+	int ret = arduboy_avr_setup(&opts);
+	worker_reply_(fd, ARDUBOY_SERVER_LOAD_ROM, ret ? ARDUBOY_SERVER_ERROR : ARDUBOY_SERVER_OK,
+			0, NULL, 0, NULL, 0);
+	if (!ret) {
+		ret = worker_serve_(fd);
+		arduboy_avr_teardown();
+	}
+	/* _exit() skips stdio cleanup, keep the session's reports */
+	fflush(stdout);
+	_exit(ret ? 1 : 0);
+}
+
+static void conn_close_(struct server_conn *conn)
+{
+	struct server_conn **pp = &mod_s.conns;
+	while (*pp != conn) {
+		pp = &(*pp)->next;
+	}
+	*pp = conn->next;
+	/* a forked worker may still hold the file description open */
+	epoll_ctl(mod_s.epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	free(conn);
+}
+
+/* Best effort error response from the event loop, never blocks */
+static void conn_reject_(struct server_conn *conn, uint8_t status)
+{
+	struct arduboy_server_msg rsp = {
+		.op = conn->req.op,
+		.status = status,
+	};
+	send(conn->fd, &rsp, sizeof(rsp), MSG_DONTWAIT | MSG_NOSIGNAL);
+	conn_close_(conn);
+}
+
+static void conn_start_session_(struct server_conn *conn)
+{
+	if (conn->req.op != ARDUBOY_SERVER_LOAD_ROM || conn->req.len == 0) {
+		conn_reject_(conn, ARDUBOY_SERVER_BAD_REQUEST);
+		return;
+	}
+	int slot = 0;
+	while (slot < mod_s.opts->max_sessions && mod_s.workers[slot]) {
+		slot++;
+	}
+	if (slot == mod_s.opts->max_sessions) {
+		conn_reject_(conn, ARDUBOY_SERVER_BUSY);
+		return;
+	}
+	conn->path[conn->req.len] = '\0';
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		conn_reject_(conn, ARDUBOY_SERVER_ERROR);
+		return;
+	}
+	if (pid == 0) {
+		worker_main_(conn);
+	}
+	mod_s.workers[slot] = pid;
+	mod_s.worker_count++;
+	/* the worker owns the connection now */
+	conn_close_(conn);
+}
+
+static void conn_readable_(struct server_conn *conn)
+{
+	const size_t hdr_len = sizeof(conn->req);
+	while (conn->rx_len < hdr_len || conn->rx_len < hdr_len + conn->req.len) {
+		uint8_t *dst;
+		size_t want;
+		if (conn->rx_len < hdr_len) {
+			dst = (uint8_t *)&conn->req + conn->rx_len;
+			want = hdr_len - conn->rx_len;
+		} else {
+			if (conn->req.len >= sizeof(conn->path)) {
+				conn_reject_(conn, ARDUBOY_SERVER_BAD_REQUEST);
+				return;
+			}
+			dst = (uint8_t *)conn->path + (conn->rx_len - hdr_len);
+			want = hdr_len + conn->req.len - conn->rx_len;
+		}
+		ssize_t n = recv(conn->fd, dst, want, 0);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			/* wait for the rest of the request */
+			return;
+		}
+		if (n <= 0) {
+			conn_close_(conn);
+			return;
+		}
+		conn->rx_len += n;
+	}
+	conn_start_session_(conn);
+}
+
+static void accept_conns_(void)
+{
+	for (;;) {
+		int fd = accept4(mod_s.listen_fd, NULL, NULL, SOCK_NONBLOCK);
+		if (fd < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("accept");
+			}
+			return;
+		}
+		struct server_conn *conn = calloc(1, sizeof(*conn));
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = conn,
+		};
+		if (!conn || epoll_ctl(mod_s.epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			free(conn);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->next = mod_s.conns;
+		mod_s.conns = conn;
+	}
+}
+
+static void reap_workers_(int options)
+{
+	pid_t pid;
+	while (mod_s.worker_count && (pid = waitpid(-1, NULL, options)) > 0) {
+		for (int slot = 0; slot < mod_s.opts->max_sessions; slot++) {
+			if (mod_s.workers[slot] == pid) {
+				mod_s.workers[slot] = 0;
+				mod_s.worker_count--;
+				break;
+			}
+		}
+	}
+}
+
+/* Returns true when the server should quit */
+static bool handle_signals_(void)
+{
+	struct signalfd_siginfo info;
+	bool quit = false;
+	while (read(mod_s.signal_fd, &info, sizeof(info)) == sizeof(info)) {
+		if (info.ssi_signo == SIGCHLD) {
+			reap_workers_(WNOHANG);
+		} else {
+			quit = true;
+		}
+	}
+	return quit;
+}
+
+static int server_listen_(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, SOMAXCONN)) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int arduboy_server_run(struct sim_arduboy_opts *opts)
+{
+	int ret = -1;
+
+	memset(&mod_s, 0, sizeof(mod_s));
+	mod_s.opts = opts;
+	mod_s.listen_fd = mod_s.epoll_fd = mod_s.signal_fd = -1;
+	mod_s.workers = calloc(opts->max_sessions, sizeof(pid_t));
+	if (!mod_s.workers) {
+		return -1;
+	}
+
+	/* signals are handled synchronously by the event loop */
+	sigset_t mask, old_mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, &old_mask);
+	signal(SIGPIPE, SIG_IGN);
+
+	mod_s.signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+	mod_s.epoll_fd = epoll_create1(0);
+	mod_s.listen_fd = server_listen_(opts->server_path);
+	if (mod_s.signal_fd < 0 || mod_s.epoll_fd < 0 || mod_s.listen_fd < 0) {
+		goto done;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = &mod_s.listen_fd,
+	};
+	epoll_ctl(mod_s.epoll_fd, EPOLL_CTL_ADD, mod_s.listen_fd, &ev);
+	ev.data.ptr = &mod_s.signal_fd;
+	epoll_ctl(mod_s.epoll_fd, EPOLL_CTL_ADD, mod_s.signal_fd, &ev);
+
+	printf("Listening on %s, up to %d sessions\n", opts->server_path, opts->max_sessions);
+	fflush(stdout);
+
+	bool quit = false;
+	while (!quit) {
+		struct epoll_event events[MAX_EVENTS];
+		int n = epoll_wait(mod_s.epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			goto done;
+		}
+		for (int i = 0; i < n; i++) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &mod_s.listen_fd) {
+				accept_conns_();
+			} else if (ptr == &mod_s.signal_fd) {
+				quit |= handle_signals_();
+			} else {
+				conn_readable_(ptr);
+			}
+		}
+	}
+	ret = 0;
+
+done:
+	while (mod_s.conns) {
+		conn_close_(mod_s.conns);
+	}
+	for (int slot = 0; slot < opts->max_sessions; slot++) {
+		if (mod_s.workers[slot]) {
+			kill(mod_s.workers[slot], SIGTERM);
+		}
+	}
+	reap_workers_(0);
+	if (mod_s.listen_fd >= 0) {
+		close(mod_s.listen_fd);
+		unlink(opts->server_path);
+	}
+	if (mod_s.epoll_fd >= 0) {
+		close(mod_s.epoll_fd);
+	}
+	if (mod_s.signal_fd >= 0) {
+		close(mod_s.signal_fd);
+	}
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	free(mod_s.workers);
+	return ret;
+}
+
+#else
+
+int arduboy_server_run(struct sim_arduboy_opts *opts)
+{
+	fprintf(stderr, "Server mode is only supported on Linux\n");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdint.h>
+
+
+/*
+Simulation server protocol, host byte order.
+
+Every request and response starts with a struct arduboy_server_msg
+followed by `len` bytes of payload. Each connection hosts one session:
+the first request must be ARDUBOY_SERVER_LOAD_ROM, every other request
+gets exactly one response with the same `op`.
+
+	LOAD_ROM     payload: path of the .hex file (no terminator)
+	SET_BUTTONS  arg: bit n set to press button_e n
+	STEP_FRAMES  arg: frames to run; response arg: frames actually run
+	GET_FRAME    response payload: struct arduboy_server_frame + luma map
+	SNAPSHOT     response payload: struct arduboy_server_snapshot + data space
+	CLOSE        ends the session, the connection is closed after the response
+*/
+
+enum arduboy_server_op {
+	ARDUBOY_SERVER_LOAD_ROM = 1,
+	ARDUBOY_SERVER_SET_BUTTONS,
+	ARDUBOY_SERVER_STEP_FRAMES,
+	ARDUBOY_SERVER_GET_FRAME,
+	ARDUBOY_SERVER_SNAPSHOT,
+	ARDUBOY_SERVER_CLOSE,
+};
+
+enum arduboy_server_status {
+	ARDUBOY_SERVER_OK = 0,
+	ARDUBOY_SERVER_ERROR,
+	ARDUBOY_SERVER_BUSY,
+	ARDUBOY_SERVER_BAD_REQUEST,
+};
+
+struct arduboy_server_msg {
+	uint8_t op;
+	uint8_t status;
+	uint16_t reserved;
+	uint32_t arg;
+	uint32_t len;
+};
+
+struct arduboy_server_frame {
+	uint64_t frame;
+	uint64_t cycle;
+	uint8_t buttons;
+	uint8_t reserved[7];
+};
+
+struct arduboy_server_snapshot {
+	uint64_t cycle;
+	uint32_t pc;
+	uint8_t sreg;
+	uint8_t state;
+	uint16_t reserved;
+	uint32_t data_size;
+	uint32_t reserved2;
+};
+
+struct sim_arduboy_opts;
+
+int arduboy_server_run(struct sim_arduboy_opts *opts);
@@ -0,0 +1,139 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sim_arduboy.h"
+#include "arduboy_shm.h"
+
+
+#define SHM_SIZE (sizeof(struct arduboy_shm) + OLED_WIDTH_PX*OLED_HEIGHT_PX)
+
+static struct mod_state {
+	struct arduboy_shm *shm;
+	const char *name;
+	uint8_t input_buttons;
+} mod_s;
+
+
+int arduboy_shm_setup(const char *name, uint8_t **luma_pixmap)
+{
+	/* never take over, and later unlink, a segment another simulator is publishing */
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0 && errno == EEXIST) {
+		fprintf(stderr, "Shared memory segment %s already exists: "
+				"another simulator is using it, or remove /dev/shm%s if it is stale\n", name, name);
+		return -1;
+	}
+	if (fd < 0) {
+		perror("shm_open");
+		return -1;
+	}
+	if (ftruncate(fd, SHM_SIZE) < 0) {
+		perror("ftruncate");
+		close(fd);
+		shm_unlink(name);
+		return -1;
+	}
+	void *addr = mmap(NULL, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	/* the mapping stays valid after the descriptor is closed */
+	close(fd);
+	if (addr == MAP_FAILED) {
+		perror("mmap");
+		shm_unlink(name);
+		return -1;
+	}
+
+	struct arduboy_shm *shm = addr;
+	memset(shm, 0, SHM_SIZE);
+	shm->version = ARDUBOY_SHM_VERSION;
+	shm->width = OLED_WIDTH_PX;
+	shm->height = OLED_HEIGHT_PX;
+	/* publish magic last so readers never see a half initialised header */
+	__atomic_store_n(&shm->magic, ARDUBOY_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	mod_s.shm = shm;
+	mod_s.name = name;
+	mod_s.input_buttons = 0;
+	*luma_pixmap = shm->luma;
+	return 0;
+}
+
+void arduboy_shm_frame_begin(void)
+{
+	struct arduboy_shm *shm = mod_s.shm;
+	if (!shm) {
+		return;
+	}
+	/* odd sequence number: update in progress */
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void arduboy_shm_frame_end(uint64_t frame, uint64_t cycle, uint8_t buttons)
+{
+	struct arduboy_shm *shm = mod_s.shm;
+	if (!shm) {
+		return;
+	}
+	shm->frame = frame;
+	shm->cycle = cycle;
+	shm->buttons = buttons;
+	/* even sequence number: frame is consistent */
+	__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+Returns a mask of the buttons whose state was changed by a reader since
+the last call and stores the requested state of all buttons in *buttons.
+*/
+uint8_t arduboy_shm_poll_input(uint8_t *buttons)
+{
+	struct arduboy_shm *shm = mod_s.shm;
+	if (!shm) {
+		return 0;
+	}
+	uint8_t input = __atomic_load_n(&shm->input_buttons, __ATOMIC_ACQUIRE);
+	uint8_t changed = input ^ mod_s.input_buttons;
+	mod_s.input_buttons = input;
+	*buttons = input;
+	return changed;
+}
+
+size_t arduboy_shm_mem_size(void)
+{
+	return mod_s.shm ? SHM_SIZE : 0;
+}
+
+void arduboy_shm_teardown(void)
+{
+	if (!mod_s.shm) {
+		return;
+	}
+	munmap(mod_s.shm, SHM_SIZE);
+	shm_unlink(mod_s.name);
+	mod_s.shm = NULL;
+}
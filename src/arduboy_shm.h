@@ -0,0 +1,73 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define ARDUBOY_SHM_MAGIC (0x42445241) /* "ARDB" */
+#define ARDUBOY_SHM_VERSION (1)
+
+/*
+Layout of the POSIX shared memory segment published with -s.
+
+The simulator integrates the luma map in place inside the segment so
+publishing a frame costs no copies. `seq` is a seqlock: it is odd while
+the simulator is updating `frame`, `cycle`, `buttons` and `luma`.
+Readers should:
+
+	do {
+		s1 = atomic_load_acquire(&shm->seq);
+		if (s1 & 1) continue;
+		copy frame, cycle, buttons and luma;
+		atomic_thread_fence_acquire();
+		s2 = atomic_load_relaxed(&shm->seq);
+	} while (s1 & 1 || s1 != s2);
+
+Readers may drive the buttons by storing a bitmask (bit n for button_e n)
+into `input_buttons`, the simulator applies changes once per render
+frame (GL_FRAME_PERIOD_US).
+
+`frame` counts luma frames. They are produced once per render frame, or
+once per SSD1306 frame period when presenting with vsync (-V).
+*/
+struct arduboy_shm {
+	/* constant after setup */
+	uint32_t magic;
+	uint16_t version;
+	uint16_t width;
+	uint16_t height;
+	/* written by readers */
+	uint8_t input_buttons;
+	uint8_t reserved;
+	/* written by the simulator */
+	uint32_t seq;
+	uint64_t frame;
+	uint64_t cycle;
+	uint8_t buttons;
+	uint8_t reserved2[7];
+	uint8_t luma[];
+};
+
+int arduboy_shm_setup(const char *name, uint8_t **luma_pixmap);
+void arduboy_shm_frame_begin(void);
+void arduboy_shm_frame_end(uint64_t frame, uint64_t cycle, uint8_t buttons);
+uint8_t arduboy_shm_poll_input(uint8_t *buttons);
+size_t arduboy_shm_mem_size(void);
+void arduboy_shm_teardown(void);
@@ -19,6 +19,7 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,11 +27,20 @@
 #include "sim_arduboy.h"
 #include "arduboy_avr.h"
 #include "arduboy_sdl.h"
+#include "arduboy_server.h"
 
 
+static volatile sig_atomic_t quit_requested;
+
+static void quit_signal_handler(int sig)
+{
+	quit_requested = 1;
+}
+
 void print_usage(char *argv[])
 {
-	fprintf(stderr, "%s [-d] [-v] [-p pixel_size] [-k keymap] filename.hex\n", argv[0]);
+	fprintf(stderr, "%s [-d] [-v] [-n] [-V] [-u] [-R] [-c|-C] [-l] [-m] [-a analyzer_log] [-s shm_name] [-p pixel_size] [-k keymap] filename.hex\n", argv[0]);
+	fprintf(stderr, "%s [-v] [-l] -S socket_path [-j max_sessions]\n", argv[0]);
 }
 
 long convert_string2long(const char *s)
@@ -62,8 +72,9 @@ int parse_cmdline(int argc, char *argv[], struct sim_arduboy_opts *opts)
 	opts->gdb_port = 1234;
 	opts->pixel_size = 2;
 	opts->key2btn = default_key2btn;
+	opts->max_sessions = 64;
 	/* parse command line */
-	while ((ch = getopt(argc, argv, "hdvk:g:p:")) != -1) {
+	while ((ch = getopt(argc, argv, "hdvnVuRcClma:k:g:p:s:S:j:")) != -1) {
 		switch (ch) {
 			case 'd':
 				opts->debug = true;
@@ -80,6 +91,42 @@ int parse_cmdline(int argc, char *argv[], struct sim_arduboy_opts *opts)
 			case 'k':
 				parse_keymap(opts, optarg);
 				break;
+			case 'n':
+				opts->headless = true;
+				break;
+			case 'V':
+				opts->vsync = true;
+				break;
+			case 's':
+				opts->shm_name = optarg;
+				break;
+			case 'u':
+				opts->unthrottled = true;
+				break;
+			case 'R':
+				opts->reference_loop = true;
+				break;
+			case 'C':
+				opts->predecode_verify = true;
+				/* fall through */
+			case 'c':
+				opts->predecode = true;
+				break;
+			case 'l':
+				opts->lean = true;
+				break;
+			case 'm':
+				opts->mem_report = true;
+				break;
+			case 'a':
+				opts->analyzer_log = optarg;
+				break;
+			case 'S':
+				opts->server_path = optarg;
+				break;
+			case 'j':
+				opts->max_sessions = convert_string2long(optarg);
+				break;
 			case 'h':
 				ret = 0;
 				goto usage;
@@ -92,7 +139,15 @@ int parse_cmdline(int argc, char *argv[], struct sim_arduboy_opts *opts)
 	}
 	if (argc > optind) {
 		opts->hex_file_path = argv[optind];
-	} else {
+	} else if (!opts->server_path) {
+		goto usage;
+	}
+	if (opts->max_sessions < 1) {
+		goto usage;
+	}
+	if (opts->predecode && (opts->debug || opts->reference_loop)) {
+		/* the instruction cache only runs from the batched loop */
+		fprintf(stderr, "-c/-C cannot be combined with -d or -R\n");
 		goto usage;
 	}
 	return 0;
@@ -114,6 +169,12 @@ int main (int argc, char *argv[])
 		goto done;
 	}
 
+	if (opts.server_path) {
+		/* sessions are started on request by the server */
+		ret = arduboy_server_run(&opts);
+		goto done;
+	}
+
 	opts.win_width = OLED_WIDTH_PX * opts.pixel_size;
 	opts.win_height = OLED_HEIGHT_PX * opts.pixel_size;
 
@@ -128,17 +189,30 @@ int main (int argc, char *argv[])
 
 	ret = arduboy_avr_setup(&opts);
 	if (!ret) {
-		ret = arduboy_sdl_setup(&opts);
-		if (!ret) {
-			while (!ret) {
-				ret = arduboy_sdl_loop();
-				arduboy_avr_loop();
+		if (opts.headless) {
+			/* no window: run until the CPU stops or we are told to quit */
+			signal(SIGINT, quit_signal_handler);
+			signal(SIGTERM, quit_signal_handler);
+			while (!ret && !quit_requested) {
+				ret = arduboy_avr_loop();
 			}
 			if (ret == -1) {
 				/* successful exit */
 				ret = 0;
 			}
-			arduboy_sdl_teardown();
+		} else {
+			ret = arduboy_sdl_setup(&opts);
+			if (!ret) {
+				while (!ret) {
+					ret = arduboy_sdl_loop();
+					arduboy_avr_loop();
+				}
+				if (ret == -1) {
+					/* successful exit */
+					ret = 0;
+				}
+				arduboy_sdl_teardown();
+			}
 		}
 		arduboy_avr_teardown();
 	}
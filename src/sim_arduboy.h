@@ -23,12 +23,12 @@
 #define OLED_WIDTH_PX (128)
 #define OLED_HEIGHT_PX (64)
 
-#define LUMA_INC (256*2/3)
-#define LUMA_DECAY (256/3)
-
 #define SSD1306_FRAME_PERIOD_US (7572)
 #define GL_FRAME_PERIOD_US (SSD1306_FRAME_PERIOD_US*4)
 
+/* pixel persistence time constant */
+#define LUMA_TAU_US (SSD1306_FRAME_PERIOD_US)
+
 
 enum button_e {
 	BTN_UP = 0,
@@ -51,4 +51,16 @@ struct sim_arduboy_opts {
 	int pixel_size;
 	int win_width;
 	int win_height;
+	char *shm_name;
+	bool headless;
+	bool unthrottled;
+	bool reference_loop;
+	bool predecode;
+	bool predecode_verify;
+	char *server_path;
+	int max_sessions;
+	bool lean;
+	bool mem_report;
+	char *analyzer_log;
+	bool vsync;
 };
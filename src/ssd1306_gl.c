@@ -34,7 +34,6 @@ static struct mod_state {
 	int win_width;
 	int win_height;
 	float pixel_size;
-	uint8_t luma_pixmap[SSD1306_VIRT_COLUMNS*SSD1306_VIRT_PAGES*8];
 } mod_s;
 
 
@@ -62,16 +61,29 @@ static float contrast_to_opacity_(uint8_t contrast)
 	return contrast / 512.0 + 0.5;
 }
 
-void ssd1306_gl_render(struct ssd1306_t *ssd1306)
+/* Snapshot the controller state so the frame can be drawn later, possibly by another thread */
+void ssd1306_gl_capture(struct ssd1306_gl_frame *frame, struct ssd1306_t *ssd1306, const uint8_t *luma_pixmap)
+{
+	frame->columns = ssd1306->columns;
+	frame->rows = ssd1306->rows;
+	frame->contrast = ssd1306->contrast_register;
+	frame->display_on = ssd1306_get_flag(ssd1306, SSD1306_FLAG_DISPLAY_ON);
+	frame->inverted = ssd1306_get_flag(ssd1306, SSD1306_FLAG_DISPLAY_INVERTED);
+	frame->segment_remap_0 = ssd1306_get_flag(ssd1306, SSD1306_FLAG_SEGMENT_REMAP_0);
+	frame->com_scan_normal = ssd1306_get_flag(ssd1306, SSD1306_FLAG_COM_SCAN_NORMAL);
+	memcpy(frame->luma, luma_pixmap, frame->columns*frame->rows);
+}
+
+void ssd1306_gl_render(const struct ssd1306_gl_frame *frame)
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-	if (!ssd1306_get_flag(ssd1306, SSD1306_FLAG_DISPLAY_ON)) {
+	if (!frame->display_on) {
 		return;
 	}
 
-	const uint8_t seg_remap_default = ssd1306_get_flag(ssd1306, SSD1306_FLAG_SEGMENT_REMAP_0);
-	const uint8_t seg_comscan_default = ssd1306_get_flag(ssd1306, SSD1306_FLAG_COM_SCAN_NORMAL);
+	const uint8_t seg_remap_default = frame->segment_remap_0;
+	const uint8_t seg_comscan_default = frame->com_scan_normal;
 	const float pixel_size = mod_s.pixel_size;
 
 	// Set up projection matrix
@@ -88,23 +100,23 @@ void ssd1306_gl_render(struct ssd1306_t *ssd1306)
 	glEnable (GL_BLEND);
 	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	
-	float opacity = contrast_to_opacity_(ssd1306->contrast_register);
-	int invert = ssd1306_get_flag (ssd1306, SSD1306_FLAG_DISPLAY_INVERTED);
+	float opacity = contrast_to_opacity_(frame->contrast);
+	int invert = frame->inverted;
 	gl_set_bg_colour_(invert, opacity);
 
 	glTranslatef (0, 0, 0);
 
 	glBegin (GL_QUADS);
-	glVertex2f (0, ssd1306->rows*pixel_size);
+	glVertex2f (0, frame->rows*pixel_size);
 	glVertex2f (0, 0);
-	glVertex2f (ssd1306->columns*pixel_size, 0);
-	glVertex2f (ssd1306->columns*pixel_size, ssd1306->rows*pixel_size);
+	glVertex2f (frame->columns*pixel_size, 0);
+	glVertex2f (frame->columns*pixel_size, frame->rows*pixel_size);
 	
-	uint8_t *px_ptr = mod_s.luma_pixmap;
+	const uint8_t *px_ptr = frame->luma;
 	float v_ofs = 0;
-	while (v_ofs < ssd1306->rows*pixel_size) {
+	while (v_ofs < frame->rows*pixel_size) {
 		float h_ofs = 0;
-		while (h_ofs < ssd1306->columns*pixel_size) {
+		while (h_ofs < frame->columns*pixel_size) {
 			gl_set_fg_colour_(invert, ((float)(*px_ptr))/255.0 * opacity);
 			glVertex2f(h_ofs + pixel_size, v_ofs + pixel_size);
 			glVertex2f(h_ofs, v_ofs + pixel_size);
@@ -119,37 +131,9 @@ void ssd1306_gl_render(struct ssd1306_t *ssd1306)
 	glEnd ();
 }
 
-void ssd1306_gl_update_lumamap(struct ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc)
-{
-	uint8_t *column_ptr = mod_s.luma_pixmap;
-	for (int p = 0; p < SSD1306_VIRT_PAGES; p++) {
-		for (int c = 0; c < SSD1306_VIRT_COLUMNS; c++) {
-			uint8_t px_col = ssd1306->vram[p][c];
-			for (int px_idx = 0; px_idx < 8*SSD1306_VIRT_COLUMNS; px_idx += SSD1306_VIRT_COLUMNS) {
-				int16_t luma = column_ptr[px_idx];
-				luma -= luma_decay;
-				if (px_col & 0x1) {
-					luma += luma_inc;
-				}
-				/* clamp value to [0, 255] */
-				if (luma < 0) {
-					luma = 0;
-				} else if (luma > 255) {
-					luma = 255;
-				}
-				column_ptr[px_idx] = luma;
-				px_col >>= 1;
-			}
-			column_ptr++;
-		}
-		column_ptr += SSD1306_VIRT_COLUMNS*7;
-	}
-}
-
 void ssd1306_gl_init(float pixel_size, int win_width, int win_height)
 {
 	mod_s.win_width = win_width;
 	mod_s.win_height = win_height;
 	mod_s.pixel_size = pixel_size;
-	memset(&mod_s.luma_pixmap, 0, sizeof(mod_s.luma_pixmap));
 }
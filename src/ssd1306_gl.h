@@ -17,10 +17,23 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdbool.h>
 #include <stdint.h>
 
-struct ssd1306_t;
+#include <ssd1306_virt.h>
 
-void ssd1306_gl_update_lumamap(struct ssd1306_t *ssd1306, const uint8_t luma_decay, const uint8_t luma_inc);
-void ssd1306_gl_render(struct ssd1306_t *ssd1306);
+/* Everything needed to draw one frame, detached from the controller */
+struct ssd1306_gl_frame {
+	uint8_t columns;
+	uint8_t rows;
+	uint8_t contrast;
+	bool display_on;
+	bool inverted;
+	bool segment_remap_0;
+	bool com_scan_normal;
+	uint8_t luma[SSD1306_VIRT_PAGES*8*SSD1306_VIRT_COLUMNS];
+};
+
+void ssd1306_gl_capture(struct ssd1306_gl_frame *frame, struct ssd1306_t *ssd1306, const uint8_t *luma_pixmap);
+void ssd1306_gl_render(const struct ssd1306_gl_frame *frame);
 void ssd1306_gl_init(float pixel_size, int win_width, int win_height);
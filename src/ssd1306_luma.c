@@ -0,0 +1,216 @@
+/*
+	Copyright 2017 Delio Brignoli <brignoli.delio@gmail.com>
+
+	Arduboy board implementation using simavr.
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Event driven pixel persistence.
+
+Each pixel's luminance approaches 1 while the pixel is on and decays
+towards 0 while it is off, with time constant tau. The level only needs
+to be integrated when a pixel changes state, so the SPI data write path
+records, per page byte, the cycle of the last transition together with
+the levels of its 8 pixels at that cycle. The luma map is computed
+lazily from that state when a frame is presented, and not at all once
+every pixel has settled.
+*/
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sim_avr.h>
+#include <sim_time.h>
+#include <ssd1306_virt.h>
+
+#include "ssd1306_luma.h"
+
+
+#define LUMA_LEVEL_MAX (0xff)
+/* after this many time constants every level is within 1 luma step of its target */
+#define LUMA_SETTLE_TAUS (8)
+
+static struct mod_state {
+	struct ssd1306_t *ssd1306;
+	float cycles_to_taus;
+	avr_cycle_count_t settle_cycles;
+	avr_cycle_count_t last_change;
+	bool settled;
+	uint8_t *luma_pixmap;
+	/* set when luma_pixmap was allocated here rather than provided */
+	bool own_pixmap;
+	/* levels are kept at luma precision: truncation always moves them towards the target */
+	uint8_t level[SSD1306_VIRT_PAGES*8*SSD1306_VIRT_COLUMNS];
+	/* low 32 bits of the cycle, settled bytes get re-stamped before this can wrap */
+	uint32_t byte_cycle[SSD1306_VIRT_PAGES][SSD1306_VIRT_COLUMNS];
+} mod_s;
+
+
+static inline float decay_factor_(uint32_t elapsed)
+{
+	if (!elapsed) {
+		return 1.0f;
+	}
+	if (elapsed >= mod_s.settle_cycles) {
+		return 0.0f;
+	}
+	return expf(-(float)elapsed * mod_s.cycles_to_taus);
+}
+
+static inline uint8_t pixel_level_(uint8_t level, uint8_t on, float decay)
+{
+	int32_t target = on ? LUMA_LEVEL_MAX : 0;
+	return target + (int32_t)((level - target) * decay);
+}
+
+/* Bring the levels of one page byte up to `now`, assuming `px_col` was displayed since the last transition */
+static void integrate_byte_(int page, int column, uint8_t px_col, avr_cycle_count_t now)
+{
+	float decay = decay_factor_((uint32_t)now - mod_s.byte_cycle[page][column]);
+	uint8_t *level = &mod_s.level[page*8*SSD1306_VIRT_COLUMNS + column];
+	for (int px_idx = 0; px_idx < 8*SSD1306_VIRT_COLUMNS; px_idx += SSD1306_VIRT_COLUMNS) {
+		level[px_idx] = pixel_level_(level[px_idx], px_col & 0x1, decay);
+		px_col >>= 1;
+	}
+	mod_s.byte_cycle[page][column] = now;
+}
+
+/*
+Registered after ssd1306_init() on the same IRQ, so (IRQ hooks being
+called most recently registered first) this runs before the controller
+stores the byte and advances its cursor.
+*/
+static void ssd1306_luma_spi_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	ssd1306_t *ssd1306 = param;
+
+	/* same filtering as the controller: chip select active low, data mode */
+	if (ssd1306->cs_pin || ssd1306->di_pin != SSD1306_VIRT_DATA) {
+		return;
+	}
+
+	int page = ssd1306->cursor.page;
+	int column = ssd1306->cursor.column;
+	uint8_t px_col = ssd1306->vram[page][column];
+	if (px_col == (uint8_t)value) {
+		/* no transitions, levels keep following the same targets */
+		return;
+	}
+
+	avr_cycle_count_t now = ssd1306->avr->cycle;
+	integrate_byte_(page, column, px_col, now);
+	mod_s.last_change = now;
+	mod_s.settled = false;
+}
+
+/*
+The controller may clear vram on reset without going through the data
+path. Like the SPI hook this runs first, while vram still holds what was
+displayed up to now, so bring every level up to date before it changes.
+*/
+static void ssd1306_luma_reset_hook(struct avr_irq_t *irq, uint32_t value, void *param)
+{
+	ssd1306_t *ssd1306 = param;
+	avr_cycle_count_t now = ssd1306->avr->cycle;
+	for (int p = 0; p < SSD1306_VIRT_PAGES; p++) {
+		for (int c = 0; c < SSD1306_VIRT_COLUMNS; c++) {
+			integrate_byte_(p, c, ssd1306->vram[p][c], now);
+		}
+	}
+	mod_s.last_change = now;
+	mod_s.settled = false;
+}
+
+/*
+Compute the luma map at the current cycle. Returns false, leaving the
+luma map untouched, when nothing changed since the last call.
+*/
+bool ssd1306_luma_update(void)
+{
+	if (mod_s.settled) {
+		return false;
+	}
+
+	ssd1306_t *ssd1306 = mod_s.ssd1306;
+	avr_cycle_count_t now = ssd1306->avr->cycle;
+	uint8_t *column_ptr = mod_s.luma_pixmap;
+	const uint8_t *level_ptr = mod_s.level;
+	for (int p = 0; p < SSD1306_VIRT_PAGES; p++) {
+		for (int c = 0; c < SSD1306_VIRT_COLUMNS; c++) {
+			uint8_t px_col = ssd1306->vram[p][c];
+			uint32_t elapsed = (uint32_t)now - mod_s.byte_cycle[p][c];
+			if (elapsed >= mod_s.settle_cycles) {
+				/* store the levels reached so the timestamp may safely wrap from now on */
+				integrate_byte_(p, c, px_col, now);
+				elapsed = 0;
+			}
+			float decay = decay_factor_(elapsed);
+			for (int px_idx = 0; px_idx < 8*SSD1306_VIRT_COLUMNS; px_idx += SSD1306_VIRT_COLUMNS) {
+				column_ptr[px_idx] = pixel_level_(level_ptr[px_idx], px_col & 0x1, decay);
+				px_col >>= 1;
+			}
+			column_ptr++;
+			level_ptr++;
+		}
+		column_ptr += SSD1306_VIRT_COLUMNS*7;
+		level_ptr += SSD1306_VIRT_COLUMNS*7;
+	}
+
+	/* every level has reached its target, the luma map is final until the next transition */
+	if (now - mod_s.last_change >= mod_s.settle_cycles) {
+		mod_s.settled = true;
+	}
+	return true;
+}
+
+size_t ssd1306_luma_mem_size(void)
+{
+	return sizeof(mod_s) + (mod_s.own_pixmap ? sizeof(mod_s.level) : 0);
+}
+
+const uint8_t *ssd1306_luma_pixmap(void)
+{
+	return mod_s.luma_pixmap;
+}
+
+/*
+Integrate luma into `luma_pixmap`, e.g. a shared memory segment, or into
+a buffer of our own when it is NULL.
+*/
+int ssd1306_luma_init(struct ssd1306_t *ssd1306, uint32_t tau_us, uint8_t *luma_pixmap)
+{
+	avr_cycle_count_t tau_cycles = avr_usec_to_cycles(ssd1306->avr, tau_us);
+
+	/* levels and timestamps start out zero in bss, leave their pages untouched until used */
+	mod_s.ssd1306 = ssd1306;
+	mod_s.cycles_to_taus = 1.0f / tau_cycles;
+	mod_s.settle_cycles = LUMA_SETTLE_TAUS * tau_cycles;
+	mod_s.last_change = 0;
+	mod_s.settled = false;
+	mod_s.own_pixmap = !luma_pixmap;
+	if (!luma_pixmap) {
+		luma_pixmap = calloc(1, sizeof(mod_s.level));
+		if (!luma_pixmap) {
+			return -1;
+		}
+	}
+	mod_s.luma_pixmap = luma_pixmap;
+
+	avr_irq_register_notify(ssd1306->irq + IRQ_SSD1306_SPI_BYTE_IN, ssd1306_luma_spi_hook, ssd1306);
+	avr_irq_register_notify(ssd1306->irq + IRQ_SSD1306_RESET, ssd1306_luma_reset_hook, ssd1306);
+	return 0;
+}